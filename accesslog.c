@@ -0,0 +1,282 @@
+/*
+ * accesslog.c: access log, written by a background thread.
+ *
+ * Each request gets a line: when it was done, the method and path, the
+ * status and the bytes sent, how long it took in microseconds, and how the
+ * cache served it.
+ *
+ * Workers must not wait on the log, so each one has a ring of
+ * ACCESSLOG_RING entries that only it writes to and only the log thread
+ * reads from. A worker takes the next free entry with accesslog_next,
+ * fills it in place and hands it over with accesslog_commit. That is a
+ * load of the tail and a store of the head, with no lock and no system
+ * call. When the ring is full the entry is dropped and counted, rather
+ * than the worker waiting for room.
+ *
+ * Every ACCESSLOG_INTERVAL seconds the log thread empties the rings, turns
+ * the entries into lines, and writes them to the file ACCESSLOG_BATCH bytes
+ * at a time. The lines of one worker are in order, but those of different
+ * workers may be out of order by up to an interval.
+ */
+
+#include "common.h"
+#include "accesslog.h"
+#include <time.h>
+
+#define ACCESSLOG_RING		4096	/* entries per worker, a power of 2 */
+#define ACCESSLOG_INTERVAL	0.05	/* seconds between drains */
+#define ACCESSLOG_BATCH		(64 * 1024) /* bytes written at a time */
+#define ACCESSLOG_LINE		(ACCESSLOG_PATH + 128) /* longest line */
+
+struct accesslog_ring {
+	struct accesslog_entry entries[ACCESSLOG_RING];
+	/* the worker moves head and the log thread tail, on cache lines of
+	 * their own so that they don't bounce between the two */
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long dropped;	/* by the worker, when the ring was full */
+	unsigned long tail __attribute__((aligned(64)));
+	struct accesslog_ring *next;
+};
+
+struct accesslog {
+	int fd;
+	pthread_key_t key;	/* the ring of the calling worker */
+	struct accesslog_ring *rings; /* added at the front, never removed */
+	char buf[ACCESSLOG_BATCH]; /* lines not written yet */
+	size_t len;
+	int error;		/* a write failed, and that was reported */
+	int stopping;
+	pthread_t thread;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/* signalled by accesslog_stop */
+	struct accesslog_stats stats;
+};
+
+/* returns the monotonic time in nanoseconds, for accesslog_entry.end */
+long long
+accesslog_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* gives the calling worker a ring of its own */
+static struct accesslog_ring *
+accesslog_ring(struct accesslog *log)
+{
+	struct accesslog_ring *r;
+
+	r = Malloc(sizeof(struct accesslog_ring));
+	r->head = 0;
+	r->dropped = 0;
+	r->tail = 0;
+	pthread_mutex_lock(&log->lock);
+	r->next = log->rings;
+	log->rings = r;
+	pthread_mutex_unlock(&log->lock);
+	pthread_setspecific(log->key, r);
+	return r;
+}
+
+/* returns the entry for the calling worker to fill in, or NULL if its ring
+ * is full and the entry has to be dropped */
+struct accesslog_entry *
+accesslog_next(struct accesslog *log)
+{
+	struct accesslog_ring *r = pthread_getspecific(log->key);
+
+	if (r == NULL)
+		r = accesslog_ring(log);
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+	    ACCESSLOG_RING) {
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	return &r->entries[r->head & (ACCESSLOG_RING - 1)];
+}
+
+/* hands the entry from accesslog_next over to the log thread */
+void
+accesslog_commit(struct accesslog *log)
+{
+	struct accesslog_ring *r = pthread_getspecific(log->key);
+
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* formats e into buf as a line of the log, with offset taking its time
+ * from the monotonic clock to the time of day, and returns its length */
+static int
+accesslog_format(char *buf, const struct accesslog_entry *e, long long offset)
+{
+	long long t = e->end + offset;
+	time_t sec = t / 1000000000LL;
+	struct tm tm;
+	int n;
+
+	gmtime_r(&sec, &tm);
+	n = strftime(buf, ACCESSLOG_LINE, "%Y-%m-%dT%H:%M:%S", &tm);
+	n += snprintf(buf + n, ACCESSLOG_LINE - n,
+		      ".%03dZ %s %s %d %ld %lld %s\n",
+		      (int)(t / 1000000 % 1000),
+		      e->method[0] != '\0' ? e->method : "-",
+		      e->path[0] != '\0' ? e->path : "-", e->status, e->bytes,
+		      e->latency / 1000, e->cache);
+	return n < ACCESSLOG_LINE ? n : ACCESSLOG_LINE - 1;
+}
+
+/* writes out the lines in log->buf */
+static void
+accesslog_flush(struct accesslog *log)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < log->len) {
+		n = write(log->fd, log->buf + off, log->len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			/* keep serving, the log is not worth stopping for */
+			if (!log->error)
+				fprintf(stderr, "%s: write: %s\n", __FUNCTION__,
+					strerror(errno));
+			log->error = 1;
+			break;
+		}
+		off += n;
+	}
+	log->len = 0;
+}
+
+/* empties the rings into the file */
+static void
+accesslog_drain(struct accesslog *log)
+{
+	unsigned long head, tail, written = 0, batches = 0;
+	struct accesslog_ring *r;
+	struct timespec ts;
+	long long offset;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	offset = ts.tv_sec * 1000000000LL + ts.tv_nsec - accesslog_now();
+	pthread_mutex_lock(&log->lock);
+	r = log->rings;
+	pthread_mutex_unlock(&log->lock);
+	for (; r != NULL; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (tail = r->tail; tail != head; tail++) {
+			if (log->len + ACCESSLOG_LINE > ACCESSLOG_BATCH) {
+				accesslog_flush(log);
+				batches++;
+			}
+			log->len += accesslog_format(log->buf + log->len,
+				&r->entries[tail & (ACCESSLOG_RING - 1)],
+				offset);
+			written++;
+		}
+		/* the entries are copied out, the worker may reuse them */
+		__atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+	}
+	if (log->len > 0) {
+		accesslog_flush(log);
+		batches++;
+	}
+	pthread_mutex_lock(&log->lock);
+	log->stats.written += written;
+	log->stats.batches += batches;
+	pthread_mutex_unlock(&log->lock);
+}
+
+static void *
+accesslog_main(void *arg)
+{
+	struct accesslog *log = arg;
+	struct timespec ts;
+	long long t;
+	int stopping = 0;
+
+	t = accesslog_now();
+	while (!stopping) {
+		t += (long long)(ACCESSLOG_INTERVAL * 1e9);
+		ts.tv_sec = t / 1000000000LL;
+		ts.tv_nsec = t % 1000000000LL;
+		pthread_mutex_lock(&log->lock);
+		while (!log->stopping && accesslog_now() < t)
+			pthread_cond_timedwait(&log->wake, &log->lock, &ts);
+		stopping = log->stopping;
+		pthread_mutex_unlock(&log->lock);
+		/* when stopping, this writes what the workers left */
+		accesslog_drain(log);
+	}
+	return NULL;
+}
+
+/* starts logging requests to the end of the file at path */
+struct accesslog *
+accesslog_start(const char *path)
+{
+	struct accesslog *log;
+	pthread_condattr_t attr;
+
+	log = Malloc(sizeof(struct accesslog));
+	memset(log, 0, sizeof(struct accesslog));
+	SYS(log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644));
+	pthread_key_create(&log->key, NULL);
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&log->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	SYS(pthread_create(&log->thread, NULL, accesslog_main, log));
+	log->running = 1;
+	return log;
+}
+
+/* stops the log thread, after it has written everything that was logged.
+ * the workers must be done logging. */
+void
+accesslog_stop(struct accesslog *log)
+{
+	pthread_mutex_lock(&log->lock);
+	log->stopping = 1;
+	pthread_cond_broadcast(&log->wake);
+	pthread_mutex_unlock(&log->lock);
+	if (log->running)
+		pthread_join(log->thread, NULL);
+	log->running = 0;
+}
+
+void
+accesslog_destroy(struct accesslog *log)
+{
+	struct accesslog_ring *r;
+
+	accesslog_stop(log);
+	while ((r = log->rings) != NULL) {
+		log->rings = r->next;
+		free(r);
+	}
+	pthread_key_delete(log->key);
+	SYS(close(log->fd));
+	pthread_mutex_destroy(&log->lock);
+	pthread_cond_destroy(&log->wake);
+	free(log);
+}
+
+void
+accesslog_get_stats(struct accesslog *log, struct accesslog_stats *stats)
+{
+	struct accesslog_ring *r;
+
+	pthread_mutex_lock(&log->lock);
+	*stats = log->stats;
+	stats->dropped = 0;
+	for (r = log->rings; r != NULL; r = r->next)
+		stats->dropped += __atomic_load_n(&r->dropped,
+						  __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&log->lock);
+}
@@ -0,0 +1,39 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+/*
+ * accesslog.c: access log. workers put a fixed-size entry for each request
+ * into a ring of their own, without locks, and a background thread formats
+ * the entries and writes them to the log file in batches.
+ */
+
+#define ACCESSLOG_PATH	96	/* bytes of the path kept, with the NUL */
+
+struct accesslog;
+
+/* one request, as a worker hands it to the log */
+struct accesslog_entry {
+	long long end;		/* accesslog_now() when it was done */
+	long long latency;	/* nanoseconds it took */
+	long bytes;		/* sent to the client */
+	const char *cache;	/* how it was served, a string that stays */
+	int status;		/* HTTP status sent, 0 if none was */
+	char method[8];
+	char path[ACCESSLOG_PATH];
+};
+
+struct accesslog_stats {
+	unsigned long written;	/* entries written to the file */
+	unsigned long dropped;	/* entries lost because a ring was full */
+	unsigned long batches;	/* writes to the file */
+};
+
+struct accesslog *accesslog_start(const char *path);
+struct accesslog_entry *accesslog_next(struct accesslog *log);
+void accesslog_commit(struct accesslog *log);
+long long accesslog_now(void);
+void accesslog_stop(struct accesslog *log);
+void accesslog_destroy(struct accesslog *log);
+void accesslog_get_stats(struct accesslog *log, struct accesslog_stats *stats);
+
+#endif /* __ACCESSLOG_H__ */
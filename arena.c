@@ -0,0 +1,380 @@
+/*
+ * arena.c: size-class slab allocator for cached file bodies.
+ *
+ * malloc() fragments badly when the cache keeps replacing Pareto-sized
+ * bodies, so the resident size drifts far above the cache budget. Here each
+ * body comes either from a slab of equal-sized objects, or for bodies larger
+ * than the biggest size class, from its own page-rounded mapping. Slabs that
+ * become empty are returned to the kernel (one spare is kept per class).
+ * Objects are carved from a slab lazily, so the untouched tail of a slab is
+ * mapped but never becomes resident.
+ */
+
+#include "common.h"
+#include "arena.h"
+
+#define SLAB_SIZE	(2 << 20)	/* slabs are aligned to their size */
+#define HUGE_PAGE	(2 << 20)
+#define MIN_CLASS	64
+#define MAX_CLASS	(128 << 10)
+/* four classes per power of two between MIN_CLASS and MAX_CLASS */
+#define NR_CLASSES	45
+
+struct slab {
+	struct slab *next;	/* in the partial list of its class */
+	struct slab *prev;
+	struct slab *all_next;	/* in the list of all slabs */
+	struct slab *all_prev;
+	int hugetlb;		/* mapped with MAP_HUGETLB */
+	void *free;		/* objects that were freed */
+	char *bump;		/* objects that were never handed out */
+	char *end;
+	int class;
+	int nr_used;
+};
+
+/* objects start after the header, cache line aligned */
+#define SLAB_HDR	((sizeof(struct slab) + 63) & ~63UL)
+
+struct size_class {
+	struct slab *partial;	/* slabs with room for at least one object */
+	struct slab *spare;	/* one empty slab, kept to avoid remapping */
+};
+
+struct arena {
+	pthread_mutex_t lock;
+	struct size_class classes[NR_CLASSES];
+	struct slab *all;
+	size_t page_size;
+	int hugepages;
+	struct arena_stats stats;
+};
+
+static int
+size_class(size_t size)
+{
+	int lg;
+
+	if (size <= MIN_CLASS)
+		return 0;
+	/* size - 1 lies in [2^lg, 2^(lg + 1)) */
+	lg = 63 - __builtin_clzl(size - 1);
+	return (lg - 6) * 4 + (((size - 1) >> (lg - 2)) & 3) + 1;
+}
+
+static size_t
+class_size(int class)
+{
+	int lg, step;
+
+	if (class == 0)
+		return MIN_CLASS;
+	lg = (class - 1) / 4 + 6;
+	step = (class - 1) % 4 + 1;
+	return (1UL << lg) + step * (1UL << (lg - 2));
+}
+
+static size_t
+page_round(struct arena *a, size_t size)
+{
+	return (size + a->page_size - 1) & ~(a->page_size - 1);
+}
+
+static void *
+arena_map(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", __FUNCTION__,
+			strerror(errno));
+		exit(1);
+	}
+	return p;
+}
+
+/* maps a SLAB_SIZE aligned slab by over-mapping and trimming the ends */
+static struct slab *
+slab_map(struct arena *a, int class)
+{
+	char *p, *aligned;
+	struct slab *s;
+	int hugetlb = 0;
+
+	p = MAP_FAILED;
+	if (a->hugepages) {
+		/* huge pages are naturally aligned to the slab size */
+		p = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	if (p != MAP_FAILED) {
+		aligned = p;
+		hugetlb = 1;
+	} else {
+		p = arena_map(2 * SLAB_SIZE);
+		aligned = (char *)(((unsigned long)p + SLAB_SIZE - 1) &
+				   ~((unsigned long)SLAB_SIZE - 1));
+		if (aligned > p)
+			SYS(munmap(p, aligned - p));
+		if (p + 2 * SLAB_SIZE > aligned + SLAB_SIZE)
+			SYS(munmap(aligned + SLAB_SIZE,
+				   p + 2 * SLAB_SIZE - (aligned + SLAB_SIZE)));
+		if (a->hugepages)
+			madvise(aligned, SLAB_SIZE, MADV_HUGEPAGE);
+	}
+
+	s = (struct slab *)aligned;
+	s->next = s->prev = NULL;
+	s->hugetlb = hugetlb;
+	s->free = NULL;
+	s->bump = aligned + SLAB_HDR;
+	s->end = aligned + SLAB_SIZE;
+	s->class = class;
+	s->nr_used = 0;
+	s->all_prev = NULL;
+	s->all_next = a->all;
+	if (a->all)
+		a->all->all_prev = s;
+	a->all = s;
+	a->stats.mapped += SLAB_SIZE;
+	a->stats.nr_slabs++;
+	a->stats.nr_hugetlb += hugetlb;
+	return s;
+}
+
+static void
+slab_unmap(struct arena *a, struct slab *s)
+{
+	if (s->all_prev)
+		s->all_prev->all_next = s->all_next;
+	else
+		a->all = s->all_next;
+	if (s->all_next)
+		s->all_next->all_prev = s->all_prev;
+	a->stats.mapped -= SLAB_SIZE;
+	a->stats.nr_slabs--;
+	a->stats.nr_hugetlb -= s->hugetlb;
+	SYS(munmap(s, SLAB_SIZE));
+}
+
+static void
+partial_add(struct size_class *sc, struct slab *s)
+{
+	s->prev = NULL;
+	s->next = sc->partial;
+	if (sc->partial)
+		sc->partial->prev = s;
+	sc->partial = s;
+}
+
+static void
+partial_remove(struct size_class *sc, struct slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		sc->partial = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	s->next = s->prev = NULL;
+}
+
+static int
+slab_full(struct slab *s, size_t osize)
+{
+	return s->free == NULL && s->bump + osize > s->end;
+}
+
+struct arena *
+arena_init(int hugepages)
+{
+	struct arena *a;
+
+	a = Malloc(sizeof(struct arena));
+	memset(a, 0, sizeof(struct arena));
+	pthread_mutex_init(&a->lock, NULL);
+	a->page_size = sysconf(_SC_PAGESIZE);
+	a->hugepages = hugepages;
+	a->stats.mapped = sizeof(struct arena);
+	return a;
+}
+
+/* releases all slabs. large blocks are released by their owners. */
+void
+arena_destroy(struct arena *a)
+{
+	while (a->all)
+		slab_unmap(a, a->all);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
+
+/* bytes that an allocation of size really takes up */
+size_t
+arena_charge(struct arena *a, size_t size)
+{
+	if (size == 0)
+		return 0;
+	if (size > MAX_CLASS)
+		return page_round(a, size);
+	return class_size(size_class(size));
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct size_class *sc;
+	struct slab *s;
+	size_t osize;
+	void *p;
+
+	if (size == 0)
+		return NULL;
+	if (size > MAX_CLASS) {
+		osize = page_round(a, size);
+		p = arena_map(osize);
+		if (a->hugepages && osize >= HUGE_PAGE)
+			madvise(p, osize, MADV_HUGEPAGE);
+		pthread_mutex_lock(&a->lock);
+		a->stats.mapped += osize;
+		a->stats.allocated += osize;
+		a->stats.requested += size;
+		a->stats.nr_large++;
+		pthread_mutex_unlock(&a->lock);
+		return p;
+	}
+
+	osize = class_size(size_class(size));
+	sc = &a->classes[size_class(size)];
+	pthread_mutex_lock(&a->lock);
+	s = sc->partial;
+	if (s == NULL) {
+		if (sc->spare) {
+			s = sc->spare;
+			sc->spare = NULL;
+		} else {
+			s = slab_map(a, size_class(size));
+		}
+		partial_add(sc, s);
+	}
+	if (s->free) {
+		p = s->free;
+		s->free = *(void **)p;
+	} else {
+		p = s->bump;
+		s->bump += osize;
+	}
+	s->nr_used++;
+	if (slab_full(s, osize))
+		partial_remove(sc, s);
+	a->stats.allocated += osize;
+	a->stats.requested += size;
+	pthread_mutex_unlock(&a->lock);
+	return p;
+}
+
+/* size must be the size that ptr was allocated with */
+void
+arena_free(struct arena *a, void *ptr, size_t size)
+{
+	struct size_class *sc;
+	struct slab *s;
+	size_t osize;
+
+	if (ptr == NULL)
+		return;
+	if (size > MAX_CLASS) {
+		osize = page_round(a, size);
+		SYS(munmap(ptr, osize));
+		pthread_mutex_lock(&a->lock);
+		a->stats.mapped -= osize;
+		a->stats.allocated -= osize;
+		a->stats.requested -= size;
+		a->stats.nr_large--;
+		pthread_mutex_unlock(&a->lock);
+		return;
+	}
+
+	s = (struct slab *)((unsigned long)ptr & ~((unsigned long)SLAB_SIZE - 1));
+	osize = class_size(s->class);
+	assert(s->class == size_class(size));
+	sc = &a->classes[s->class];
+	pthread_mutex_lock(&a->lock);
+	if (slab_full(s, osize))
+		partial_add(sc, s);
+	*(void **)ptr = s->free;
+	s->free = ptr;
+	s->nr_used--;
+	a->stats.allocated -= osize;
+	a->stats.requested -= size;
+	if (s->nr_used == 0) {
+		/* keep one empty slab per class, give the rest back */
+		partial_remove(sc, s);
+		if (sc->spare) {
+			slab_unmap(a, s);
+		} else {
+			s->free = NULL;
+			s->bump = (char *)s + SLAB_HDR;
+			/* drop the pages, but not the header page. that
+			 * would split a huge page, so keep those whole. */
+			if (!a->hugepages)
+				madvise((char *)s + a->page_size,
+					SLAB_SIZE - a->page_size,
+					MADV_DONTNEED);
+			sc->spare = s;
+		}
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+/* returns the spare empty slabs to the kernel */
+void
+arena_trim(struct arena *a)
+{
+	int i;
+
+	pthread_mutex_lock(&a->lock);
+	for (i = 0; i < NR_CLASSES; i++) {
+		if (a->classes[i].spare) {
+			slab_unmap(a, a->classes[i].spare);
+			a->classes[i].spare = NULL;
+		}
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+void
+arena_get_stats(struct arena *a, struct arena_stats *stats)
+{
+	pthread_mutex_lock(&a->lock);
+	*stats = a->stats;
+	pthread_mutex_unlock(&a->lock);
+}
+
+/* maps zeroed memory for large tables, preferably on huge pages. with
+ * hugepages the size is rounded up to whole huge pages either way, so that
+ * arena_unmap_pages() knows what to unmap. */
+void *
+arena_map_pages(size_t size, int hugepages)
+{
+	void *p;
+
+	if (!hugepages)
+		return arena_map(size);
+	size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1UL);
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+	p = arena_map(size);
+	madvise(p, size, MADV_HUGEPAGE);
+	return p;
+}
+
+void
+arena_unmap_pages(void *ptr, size_t size, int hugepages)
+{
+	if (hugepages)
+		size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1UL);
+	SYS(munmap(ptr, size));
+}
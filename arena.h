@@ -0,0 +1,39 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * arena.c: allocator for cached file bodies.
+ *
+ * Small bodies come from size-class slabs, large bodies from page-granular
+ * mappings. Every byte obtained from the kernel is accounted for, so the
+ * cache can charge exactly what a body costs.
+ *
+ * With hugepages set, memory comes from 2MB pages to cut TLB misses when
+ * bodies are walked: reserved hugetlbfs pages if there are any, otherwise
+ * transparent huge pages.
+ */
+
+struct arena;
+
+struct arena_stats {
+	size_t mapped;		/* bytes mapped from the kernel, headers too */
+	size_t allocated;	/* bytes handed out, rounded to block sizes */
+	size_t requested;	/* bytes asked for by callers */
+	unsigned long nr_slabs;	/* slabs mapped, including empty ones */
+	unsigned long nr_large;	/* page-granular blocks mapped */
+	unsigned long nr_hugetlb; /* slabs backed by reserved huge pages */
+};
+
+struct arena *arena_init(int hugepages);
+void arena_destroy(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_free(struct arena *a, void *ptr, size_t size);
+size_t arena_charge(struct arena *a, size_t size);
+void arena_trim(struct arena *a);
+void arena_get_stats(struct arena *a, struct arena_stats *stats);
+void *arena_map_pages(size_t size, int hugepages);
+void arena_unmap_pages(void *ptr, size_t size, int hugepages);
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,138 @@
+#include <popt.h>
+#include <time.h>
+#include "common.h"
+#include "request.h"
+#include "server_thread.h"
+
+/* Fills the cache with millions of entries and looks every one of them up
+ * again, timing both. The slowest insert is reported too, since the table
+ * grows as the entries come in, and that must not stall any one insert.
+ *
+ * With a cache too small for all of them, the oldest entries are evicted
+ * while the table grows (the policy is LRU), and the check is that exactly
+ * the newest ones are found. */
+
+#define DEFAULT_FILES 10000000
+
+/* inserts slower than this are counted */
+#define SLOW_INSERT 1e-3
+
+static long files = DEFAULT_FILES;
+static long cache_size = 0;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+file_name(char *buf, size_t max, long i)
+{
+	snprintf(buf, max, "files/%09ld", i);
+}
+
+/* file data for file i, with an empty body. the cache takes the only
+ * reference and frees it when the entry goes. */
+static struct file_data *
+file_data(long i)
+{
+	struct file_data *data = Malloc(sizeof(struct file_data));
+	char name[32];
+
+	memset(data, 0, sizeof(struct file_data));
+	file_name(name, sizeof(name), i);
+	data->file_name = strdup(name);
+	data->file_name_max = strlen(name) + 1;
+	data->file_storage = FILE_STORAGE_HEAP;
+	data->file_ready = 1;
+	return data;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct server_options opts;
+	struct file_data *data;
+	struct server *sv;
+	poptContext context;
+	double start, t, slowest = 0;
+	long i, slow = 0, failed = 0, first = -1, found = 0;
+	char name[32];
+	int c;
+
+	struct poptOption options_table[] = {
+		{NULL, 'n', POPT_ARG_LONG, &files, 'n',
+		 "files to cache", " default: " STR(DEFAULT_FILES)},
+		{NULL, 'c', POPT_ARG_LONG, &cache_size, 'c',
+		 "cache size in bytes", " default: enough for all the files"},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	if (files <= 0) {
+		fprintf(stderr, "the number of files must be positive\n");
+		exit(1);
+	}
+	if (cache_size < 0) {
+		fprintf(stderr, "the cache size can't be negative\n");
+		exit(1);
+	}
+	poptFreeContext(context);
+
+	server_options_init(&opts);
+	opts.policy = CACHE_POLICY_LRU;
+	/* about 250 bytes per entry, the rest is to spare */
+	sv = server_init(0, 0, cache_size > 0 ? cache_size : files * 1024,
+			 &opts);
+
+	start = now();
+	for (i = 0; i < files; i++) {
+		data = file_data(i);
+		t = now();
+		if (cache_insert(sv, data) == NULL) {
+			failed++;
+			free(data->file_name);
+			free(data);
+		}
+		t = now() - t;
+		if (t > slowest)
+			slowest = t;
+		if (t > SLOW_INSERT)
+			slow++;
+	}
+	t = now() - start;
+	printf("insert: %ld files, %.0f ns each, slowest %.3f ms, %ld over "
+	       "%.0f ms, %ld did not fit\n", files, t / files * 1e9,
+	       slowest * 1e3, slow, SLOW_INSERT * 1e3, failed);
+
+	start = now();
+	for (i = 0; i < files; i++) {
+		file_name(name, sizeof(name), i);
+		if (cache_lookup(sv, name) == NULL)
+			continue;
+		if (first < 0)
+			first = i;
+		found++;
+	}
+	t = now() - start;
+	printf("lookup: %.0f ns each, %ld found\n", t / files * 1e9, found);
+	/* LRU keeps a run of the newest files, and every one of them has to
+	 * be found wherever it is in the table */
+	if (failed > 0 || found == 0 || first + found != files) {
+		fprintf(stderr, "lookup: the cache lost files\n");
+		exit(1);
+	}
+	server_exit(sv);
+	exit(0);
+}
@@ -108,7 +108,7 @@ main(int argc, const char *argv[])
 	/* null terminate the buffer */
 	idx_buffer[0] = 0;
 	while (current_fileset_sz < total_fileset_sz) {
-		char name[10];
+		char name[16];	/* "/", an int, and the NUL */
 		int fd, file_sz, remaining;
 		char buf[4096];
 		double ms = default_file_sz;
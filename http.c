@@ -0,0 +1,324 @@
+/*
+ * http.c: incremental parser for HTTP request heads.
+ *
+ * The parser runs over a request head as it arrives in a buffer owned by
+ * the caller. It keeps its place between calls, so a head that comes in
+ * several reads is scanned once rather than from the start after each one,
+ * and the caller can go do something else when a read comes up short.
+ *
+ * Nothing is copied. The method, URI, version and headers are slices of the
+ * buffer, valid for as long as the buffer is. The buffer must stay where it
+ * is while the head is parsed, with the bytes already passed unchanged.
+ *
+ * Lines may end in CRLF or a bare LF. Whitespace around header values is
+ * dropped.
+ *
+ * The URI and header lines make up most of a head (browsers send 500 bytes
+ * of headers or more), so they are not looked at byte by byte. http_scan
+ * finds the next byte that ends a part of them, or is not allowed in one: a
+ * control character, DEL, or the byte that ends the part (' ' for the URI,
+ * ':' for a header name). On x86-64 it tests 16 bytes at a time with SSE2,
+ * or 32 with AVX2 when the CPU has it, which is checked once at run time.
+ * Elsewhere it is a plain loop. Header names still have their characters
+ * checked against a table, but they are short.
+ */
+
+#include "common.h"
+#include "http.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HTTP_SIMD
+#include <immintrin.h>
+#endif
+
+enum http_state {
+	HTTP_S_METHOD,
+	HTTP_S_URI,
+	HTTP_S_VERSION,
+	HTTP_S_LINE_LF,		/* CR seen at the end of the request line */
+	HTTP_S_HEADER,		/* at the start of a header line */
+	HTTP_S_NAME,
+	HTTP_S_VALUE_START,	/* skipping whitespace after the colon */
+	HTTP_S_VALUE,
+	HTTP_S_VALUE_LF,	/* CR seen at the end of a header line */
+	HTTP_S_END_LF,		/* CR seen on the empty line */
+	HTTP_S_DONE,
+};
+
+/* characters allowed in methods and header names (RFC 9110 tchar) */
+static int
+http_token(char c)
+{
+	return isalnum((unsigned char)c) || (c != '\0' &&
+		strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+static int
+http_ctl(char c)
+{
+	return (unsigned char)c < 0x20 || c == 0x7f;
+}
+
+/* http_token as a table, filled in by http_setup */
+static unsigned char http_tokens[256];
+
+/* returns the offset of the first byte in p[0..n) that is a control
+ * character, DEL or stop, or n if there is none */
+static size_t
+http_scan_scalar(const char *p, size_t n, char stop)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (http_ctl(p[i]) || p[i] == stop)
+			break;
+	}
+	return i;
+}
+
+#ifdef HTTP_SIMD
+static size_t
+http_scan_sse2(const char *p, size_t n, char stop)
+{
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	const __m128i st = _mm_set1_epi8(stop);
+	__m128i v, hit;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		/* v <= 0x1f, unsigned */
+		hit = _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v);
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, del));
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, st));
+		mask = _mm_movemask_epi8(hit);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + http_scan_scalar(p + i, n - i, stop);
+}
+
+__attribute__((target("avx2")))
+static size_t
+http_scan_avx2(const char *p, size_t n, char stop)
+{
+	const __m256i ctl = _mm256_set1_epi8(0x1f);
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	const __m256i st = _mm256_set1_epi8(stop);
+	__m256i v, hit;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		hit = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v);
+		hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, del));
+		hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, st));
+		mask = _mm256_movemask_epi8(hit);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + http_scan_sse2(p + i, n - i, stop);
+}
+#endif
+
+static size_t (*http_scan)(const char *p, size_t n, char stop);
+static size_t (*http_scan_best)(const char *p, size_t n, char stop);
+static pthread_once_t http_once = PTHREAD_ONCE_INIT;
+
+static void
+http_setup(void)
+{
+	int c;
+
+	for (c = 0; c < 256; c++)
+		http_tokens[c] = http_token(c);
+	http_scan_best = http_scan_scalar;
+#ifdef HTTP_SIMD
+	http_scan_best = http_scan_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		http_scan_best = http_scan_avx2;
+#endif
+	http_scan = http_scan_best;
+}
+
+/* picks how http_scan runs: "scalar", "sse2", "avx2", or NULL for the best
+ * the CPU can do. returns 0 if the CPU can't. */
+int
+http_set_scan(const char *name)
+{
+	pthread_once(&http_once, http_setup);
+	if (name == NULL) {
+		http_scan = http_scan_best;
+	} else if (strcmp(name, "scalar") == 0) {
+		http_scan = http_scan_scalar;
+#ifdef HTTP_SIMD
+	} else if (strcmp(name, "sse2") == 0) {
+		http_scan = http_scan_sse2;
+	} else if (strcmp(name, "avx2") == 0 &&
+		   __builtin_cpu_supports("avx2")) {
+		http_scan = http_scan_avx2;
+#endif
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+static void
+http_slice_set(struct http_slice *s, const char *buf, size_t start,
+	       size_t end)
+{
+	s->p = buf + start;
+	s->len = end - start;
+}
+
+void
+http_parser_init(struct http_parser *hp)
+{
+	pthread_once(&http_once, http_setup);
+	memset(hp, 0, sizeof(struct http_parser));
+	hp->state = HTTP_S_METHOD;
+}
+
+/* parses the head in buf, of which len bytes have arrived so far, carrying
+ * on from where the last call stopped */
+int
+http_parse(struct http_parser *hp, const char *buf, size_t len)
+{
+	size_t i, j, end;
+	char c;
+
+	for (i = hp->pos; i < len && hp->state != HTTP_S_DONE; i++) {
+		c = buf[i];
+		switch (hp->state) {
+		case HTTP_S_METHOD:
+			if (c == ' ' && i > hp->mark) {
+				http_slice_set(&hp->method, buf, hp->mark, i);
+				hp->mark = i + 1;
+				hp->state = HTTP_S_URI;
+			} else if (!http_tokens[(unsigned char)c]) {
+				return HTTP_ERROR;
+			}
+			break;
+		case HTTP_S_URI:
+			i += http_scan(buf + i, len - i, ' ');
+			if (i == len) {
+				i = len - 1;	/* wait for the rest of the line */
+				break;
+			}
+			c = buf[i];
+			if ((c != ' ' && c != '\r' && c != '\n') || i == hp->mark)
+				return HTTP_ERROR;
+			http_slice_set(&hp->uri, buf, hp->mark, i);
+			hp->mark = i + 1;
+			hp->state = c == ' ' ? HTTP_S_VERSION :
+				c == '\r' ? HTTP_S_LINE_LF : HTTP_S_HEADER;
+			break;
+		case HTTP_S_VERSION:
+			if (c == '\r' || c == '\n') {
+				http_slice_set(&hp->version, buf, hp->mark, i);
+				hp->state = c == '\r' ? HTTP_S_LINE_LF :
+					HTTP_S_HEADER;
+			} else if (c == ' ' || http_ctl(c)) {
+				return HTTP_ERROR;
+			}
+			break;
+		case HTTP_S_LINE_LF:
+		case HTTP_S_VALUE_LF:
+			if (c != '\n')
+				return HTTP_ERROR;
+			hp->state = HTTP_S_HEADER;
+			break;
+		case HTTP_S_HEADER:
+			if (c == '\r') {
+				hp->state = HTTP_S_END_LF;
+			} else if (c == '\n') {
+				hp->state = HTTP_S_DONE;
+			} else if (http_tokens[(unsigned char)c]) {
+				hp->mark = i;
+				hp->state = HTTP_S_NAME;
+			} else {
+				/* including obsolete folded lines */
+				return HTTP_ERROR;
+			}
+			break;
+		case HTTP_S_NAME:
+			j = i;
+			i += http_scan(buf + i, len - i, ':');
+			for (; j < i; j++) {
+				if (!http_tokens[(unsigned char)buf[j]])
+					return HTTP_ERROR;
+			}
+			if (i == len) {
+				i = len - 1;
+				break;
+			}
+			if (buf[i] != ':')
+				return HTTP_ERROR;
+			http_slice_set(&hp->name, buf, hp->mark, i);
+			hp->state = HTTP_S_VALUE_START;
+			break;
+		case HTTP_S_VALUE_START:
+			if (c == ' ' || c == '\t')
+				break;
+			hp->mark = i;
+			hp->state = HTTP_S_VALUE;
+			/* fall through */
+		case HTTP_S_VALUE:
+			/* tabs are the only control characters allowed */
+			while ((i += http_scan(buf + i, len - i, 0)) < len &&
+			       buf[i] == '\t')
+				i++;
+			if (i == len) {
+				i = len - 1;
+				break;
+			}
+			c = buf[i];
+			if (c != '\r' && c != '\n')
+				return HTTP_ERROR;
+			end = i;
+			while (end > hp->mark &&
+			       (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+				end--;
+			if (hp->nr_headers < HTTP_MAX_HEADERS) {
+				hp->headers[hp->nr_headers].name = hp->name;
+				http_slice_set(&hp->headers[hp->nr_headers].value,
+					       buf, hp->mark, end);
+				hp->nr_headers++;
+			}
+			hp->state = c == '\r' ? HTTP_S_VALUE_LF : HTTP_S_HEADER;
+			break;
+		case HTTP_S_END_LF:
+			if (c != '\n')
+				return HTTP_ERROR;
+			hp->state = HTTP_S_DONE;
+			break;
+		}
+	}
+	hp->pos = i;
+	return hp->state == HTTP_S_DONE ? HTTP_DONE : HTTP_MORE;
+}
+
+/* returns 1 if s holds str, ignoring case */
+int
+http_slice_eq(const struct http_slice *s, const char *str)
+{
+	return strlen(str) == s->len && strncasecmp(s->p, str, s->len) == 0;
+}
+
+/* returns the value of the first header called name, or NULL */
+const struct http_slice *
+http_header(const struct http_parser *hp, const char *name)
+{
+	int i;
+
+	for (i = 0; i < hp->nr_headers; i++) {
+		if (http_slice_eq(&hp->headers[i].name, name))
+			return &hp->headers[i].value;
+	}
+	return NULL;
+}
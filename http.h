@@ -0,0 +1,48 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+/*
+ * http.c: incremental parser for HTTP request heads, which hands out the
+ * parts of a request as slices of the caller's buffer instead of copies.
+ */
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS 32	/* headers kept, the rest are skipped */
+
+/* http_parse results */
+#define HTTP_DONE	1	/* the head is complete */
+#define HTTP_MORE	0	/* needs more bytes */
+#define HTTP_ERROR	-1	/* not a valid request head */
+
+/* bytes in the caller's buffer, not NUL terminated */
+struct http_slice {
+	const char *p;
+	size_t len;
+};
+
+struct http_header {
+	struct http_slice name;
+	struct http_slice value;
+};
+
+struct http_parser {
+	int state;
+	size_t pos;		/* bytes parsed so far */
+	size_t mark;		/* start of the part being parsed */
+	struct http_slice method;
+	struct http_slice uri;
+	struct http_slice version;	/* empty for an HTTP/0.9 request */
+	struct http_slice name;		/* of the header being parsed */
+	struct http_header headers[HTTP_MAX_HEADERS];
+	int nr_headers;
+};
+
+void http_parser_init(struct http_parser *hp);
+int http_parse(struct http_parser *hp, const char *buf, size_t len);
+const struct http_slice *http_header(const struct http_parser *hp,
+				     const char *name);
+int http_slice_eq(const struct http_slice *s, const char *str);
+int http_set_scan(const char *name);
+
+#endif /* __HTTP_H__ */
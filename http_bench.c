@@ -0,0 +1,206 @@
+#include <popt.h>
+#include <time.h>
+#include "common.h"
+#include "http.h"
+
+/* Times http_parse over request heads like those browsers and tools send,
+ * with each way http_scan can run. Before timing, checks that each way
+ * finds the same parts as the plain loop, whether the head is parsed whole
+ * or as it would arrive a few bytes at a time. */
+
+#define DEFAULT_ITERATIONS 200000
+
+static const char *heads[] = {
+	/* curl */
+	"GET /fileset_dir/00042 HTTP/1.1\r\n"
+	"Host: localhost:8000\r\n"
+	"User-Agent: curl/8.5.0\r\n"
+	"Accept: */*\r\n"
+	"\r\n",
+	/* Chrome, first visit */
+	"GET /fileset_dir/00042 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+	"\"Not-A.Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+	"(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+	"image/avif,image/webp,image/apng,*/*;q=0.8,"
+	"application/signed-exchange;v=b3;q=0.7\r\n"
+	"Sec-Fetch-Site: none\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"\r\n",
+	/* Firefox, with cookies and a conditional request */
+	"GET /static/css/site.min.css?v=20240501 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) "
+	"Gecko/20100101 Firefox/125.0\r\n"
+	"Accept: text/css,*/*;q=0.1\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Referer: https://www.example.com/articles/2024/05/"
+	"a-rather-long-article-title-for-the-url\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: _ga=GA1.2.1234567890.1714567890; "
+	"_gid=GA1.2.987654321.1714567890; "
+	"session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3OD"
+	"kwIiwibmFtZSI6IkpvaG4gRG9lIiwiaWF0IjoxNTE2MjM5MDIyfQ.SflKxwRJSMeKKF"
+	"2QT4fwpMeJf36POk6yJV_adQssw5c; consent=analytics%3Dno%26ads%3Dno; "
+	"theme=dark; tz=Europe%2FLondon\r\n"
+	"Sec-Fetch-Dest: style\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"If-Modified-Since: Wed, 01 May 2024 10:00:00 GMT\r\n"
+	"If-None-Match: \"5f3a-61753c5d8e4c0\"\r\n"
+	"Priority: u=2\r\n"
+	"Pragma: no-cache\r\n"
+	"Cache-Control: no-cache\r\n"
+	"\r\n",
+};
+
+#define NR_HEADS (sizeof(heads) / sizeof(heads[0]))
+
+static const char *scans[] = { "scalar", "sse2", "avx2" };
+
+#define NR_SCANS (sizeof(scans) / sizeof(scans[0]))
+
+static int iterations = DEFAULT_ITERATIONS;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* parses head, handing it to the parser step bytes at a time */
+static int
+parse(struct http_parser *hp, const char *head, size_t len, size_t step)
+{
+	size_t n = 0;
+	int ret = HTTP_MORE;
+
+	http_parser_init(hp);
+	while (ret == HTTP_MORE && n < len) {
+		n = n + step < len ? n + step : len;
+		ret = http_parse(hp, head, n);
+	}
+	return ret;
+}
+
+static int
+same_slice(const struct http_slice *a, const struct http_slice *b)
+{
+	return a->p == b->p && a->len == b->len;
+}
+
+static int
+same_parse(const struct http_parser *a, const struct http_parser *b)
+{
+	int i;
+
+	if (!same_slice(&a->method, &b->method) ||
+	    !same_slice(&a->uri, &b->uri) ||
+	    !same_slice(&a->version, &b->version) ||
+	    a->nr_headers != b->nr_headers)
+		return 0;
+	for (i = 0; i < a->nr_headers; i++) {
+		if (!same_slice(&a->headers[i].name, &b->headers[i].name) ||
+		    !same_slice(&a->headers[i].value, &b->headers[i].value))
+			return 0;
+	}
+	return 1;
+}
+
+/* checks every way of scanning against the plain loop on head */
+static void
+check(const char *head)
+{
+	struct http_parser want, got;
+	size_t len = strlen(head), step;
+	unsigned int i;
+
+	http_set_scan("scalar");
+	if (parse(&want, head, len, len) != HTTP_DONE) {
+		fprintf(stderr, "check: head does not parse:\n%s", head);
+		exit(1);
+	}
+	for (i = 0; i < NR_SCANS; i++) {
+		if (!http_set_scan(scans[i]))
+			continue;
+		for (step = 1; step <= len; step = step < 64 ? step + 1 :
+			     step * 2) {
+			if (parse(&got, head, len, step) != HTTP_DONE ||
+			    !same_parse(&want, &got)) {
+				fprintf(stderr, "check: %s, %zu bytes at a "
+					"time, differs on:\n%s", scans[i],
+					step, head);
+				exit(1);
+			}
+		}
+	}
+}
+
+int
+main(int argc, const char *argv[])
+{
+	struct http_parser hp;
+	poptContext context;
+	unsigned int h, i;
+	double start, t;
+	size_t len;
+	int c, n;
+
+	struct poptOption options_table[] = {
+		{NULL, 'n', POPT_ARG_INT, &iterations, 'n',
+		 "times each head is parsed",
+		 " default: " STR(DEFAULT_ITERATIONS)},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	if (iterations <= 0) {
+		fprintf(stderr, "the number of iterations must be positive\n");
+		exit(1);
+	}
+	poptFreeContext(context);
+
+	for (h = 0; h < NR_HEADS; h++)
+		check(heads[h]);
+
+	for (h = 0; h < NR_HEADS; h++) {
+		len = strlen(heads[h]);
+		printf("head %u, %zu bytes:", h, len);
+		for (i = 0; i < NR_SCANS; i++) {
+			if (!http_set_scan(scans[i]))
+				continue;
+			start = now();
+			for (n = 0; n < iterations; n++) {
+				if (parse(&hp, heads[h], len, len) != HTTP_DONE)
+					exit(1);
+			}
+			t = (now() - start) / iterations;
+			printf(" %s %.0f ns (%.2f GB/s)", scans[i], t * 1e9,
+			       len / t / 1e9);
+		}
+		printf("\n");
+	}
+	exit(0);
+}
@@ -0,0 +1,182 @@
+/*
+ * lz.c: a small LZ77 block codec in the style of LZ4.
+ *
+ * A block is a series of sequences. Each sequence starts with a token whose
+ * high nibble is the number of literals and low nibble the match length
+ * minus LZ_MIN_MATCH, either of which continues in extra bytes of 255 when it
+ * is 15. The literals follow, then a 2 byte little endian match offset. The
+ * last sequence has literals only. Matches are found through a hash table of
+ * the positions of recently seen 4 byte strings, so compression is a single
+ * pass and decompression is little more than memcpy.
+ */
+
+#include "common.h"
+#include "lz.h"
+
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	65535
+#define LZ_HASH_BITS	13
+/* no match may start in the last bytes, they are always literals */
+#define LZ_TAIL		8
+
+static unsigned int
+lz_read32(const char *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned int
+lz_hash(const char *p)
+{
+	return (lz_read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* returns the number of bytes the rest of a length takes after its nibble */
+static int
+lz_length_bytes(int len)
+{
+	return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+/* writes the rest of a length that did not fit in its nibble */
+static char *
+lz_put_length(char *op, int len)
+{
+	while (len >= 255) {
+		*op++ = (char)255;
+		len -= 255;
+	}
+	*op++ = (char)len;
+	return op;
+}
+
+/* returns the compressed size, or 0 when it would not fit in cap bytes */
+int
+lz_compress(const char *src, int len, char *dst, int cap)
+{
+	int table[1 << LZ_HASH_BITS];
+	const char *ip = src, *anchor = src;
+	const char *end = src + len;
+	const char *limit = len > LZ_TAIL ? end - LZ_TAIL : src;
+	char *op = dst, *oend = dst + cap;
+	int i;
+
+	for (i = 0; i < (1 << LZ_HASH_BITS); i++)
+		table[i] = -1;
+
+	while (ip < limit) {
+		unsigned int h = lz_hash(ip);
+		const char *ref = table[h] >= 0 ? src + table[h] : NULL;
+		int lit, mlen;
+		char *token;
+
+		table[h] = ip - src;
+		if (ref == NULL || ip - ref > LZ_MAX_OFFSET ||
+		    lz_read32(ref) != lz_read32(ip)) {
+			ip++;
+			continue;
+		}
+		/* extend the match, stopping short of the tail */
+		mlen = LZ_MIN_MATCH;
+		while (ip + mlen < limit && ref[mlen] == ip[mlen])
+			mlen++;
+
+		lit = ip - anchor;
+		if (oend - op < 1 + lz_length_bytes(lit) + lit + 2 +
+		    lz_length_bytes(mlen - LZ_MIN_MATCH))
+			return 0;
+		token = op++;
+		*token = (char)((lit >= 15 ? 15 : lit) << 4);
+		if (lit >= 15)
+			op = lz_put_length(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (char)((ip - ref) & 0xff);
+		*op++ = (char)((ip - ref) >> 8);
+		*token |= (char)(mlen - LZ_MIN_MATCH >= 15 ?
+				 15 : mlen - LZ_MIN_MATCH);
+		if (mlen - LZ_MIN_MATCH >= 15)
+			op = lz_put_length(op, mlen - LZ_MIN_MATCH - 15);
+
+		/* remember a position inside the match too */
+		if (ip + mlen - 2 < limit)
+			table[lz_hash(ip + mlen - 2)] = ip + mlen - 2 - src;
+		ip += mlen;
+		anchor = ip;
+	}
+
+	/* last literals */
+	i = end - anchor;
+	if (oend - op < 1 + lz_length_bytes(i) + i)
+		return 0;
+	*op++ = (char)((i >= 15 ? 15 : i) << 4);
+	if (i >= 15)
+		op = lz_put_length(op, i - 15);
+	memcpy(op, anchor, i);
+	op += i;
+	return op - dst;
+}
+
+/* reads the rest of a length, returns -1 on truncated input */
+static int
+lz_get_length(const unsigned char **ipp, const unsigned char *iend)
+{
+	int len = 0;
+	unsigned char c;
+
+	do {
+		if (*ipp >= iend)
+			return -1;
+		c = *(*ipp)++;
+		len += c;
+	} while (c == 255);
+	return len;
+}
+
+/* returns the decompressed size, or -1 if src is corrupt or does not fit in
+ * cap bytes */
+int
+lz_decompress(const char *src, int len, char *dst, int cap)
+{
+	const unsigned char *ip = (const unsigned char *)src;
+	const unsigned char *iend = ip + len;
+	char *op = dst, *oend = dst + cap;
+
+	while (ip < iend) {
+		int token = *ip++;
+		int lit = token >> 4, mlen, off, n;
+
+		if (lit == 15) {
+			if ((n = lz_get_length(&ip, iend)) < 0)
+				return -1;
+			lit += n;
+		}
+		if (lit > iend - ip || lit > oend - op)
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;	/* last sequence */
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		mlen = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15) {
+			if ((n = lz_get_length(&ip, iend)) < 0)
+				return -1;
+			mlen += n;
+		}
+		if (off == 0 || off > op - dst || mlen > oend - op)
+			return -1;
+		/* byte by byte, the match may overlap its own output */
+		for (n = 0; n < mlen; n++, op++)
+			*op = *(op - off);
+	}
+	return op - dst;
+}
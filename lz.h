@@ -0,0 +1,15 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+/*
+ * lz.c: a small LZ77 block codec in the style of LZ4, used to keep cold
+ * cache entries compressed in memory.
+ */
+
+/* worst case compressed size for len bytes of input */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+int lz_compress(const char *src, int len, char *dst, int cap);
+int lz_decompress(const char *src, int len, char *dst, int cap);
+
+#endif /* __LZ_H__ */
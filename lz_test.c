@@ -0,0 +1,116 @@
+#include "common.h"
+#include "lz.h"
+
+/* Compresses inputs of many sizes and kinds, from random bytes that don't
+ * compress to long runs that do, and checks that each one decompresses to
+ * what went in. Each is then compressed again into exactly as many bytes as
+ * it needs, which has to work, and into one byte less, which has to fail.
+ * The output buffers are followed by guard bytes that must not be written,
+ * so a bound that is off by one shows up here rather than in the cache. */
+
+#define MAX_LEN	70000	/* over LZ_MAX_OFFSET, so that offsets run out */
+#define GUARD	64	/* bytes after each output buffer */
+#define SEED	1
+
+static int failed = 0;
+
+/* fills buf with len bytes of a kind of input */
+static void
+fill(char *buf, int len, int kind)
+{
+	int i, run = 0;
+	char c = 0;
+
+	for (i = 0; i < len; i++) {
+		switch (kind) {
+		case 0:		/* random, no matches */
+			buf[i] = random();
+			break;
+		case 1:		/* one byte, a single long match */
+			buf[i] = 'a';
+			break;
+		case 2:		/* runs of random length, long literals and
+				 * matches in turn */
+			if (run-- <= 0) {
+				run = random() % 600;
+				c = random();
+			}
+			buf[i] = random() % 2 ? c : random();
+			break;
+		default:	/* text-like, short matches */
+			buf[i] = "the cache of the server "[random() % 24];
+			break;
+		}
+	}
+}
+
+/* returns 1 if the guard bytes after cap bytes of out are untouched */
+static int
+guard_ok(const char *out, int cap)
+{
+	int i;
+
+	for (i = 0; i < GUARD; i++)
+		if (out[cap + i] != (char)0xa5)
+			return 0;
+	return 1;
+}
+
+static void
+check(const char *src, int len, int kind)
+{
+	static char out[LZ_BOUND(MAX_LEN) + GUARD], back[MAX_LEN + GUARD];
+	int n, m;
+
+	memset(out, 0xa5, sizeof(out));
+	n = lz_compress(src, len, out, LZ_BOUND(len));
+	if (n <= 0 || n > LZ_BOUND(len) || !guard_ok(out, LZ_BOUND(len))) {
+		fprintf(stderr, "len %d kind %d: compress returned %d\n",
+			len, kind, n);
+		failed++;
+		return;
+	}
+	m = lz_decompress(out, n, back, len);
+	if (m != len || memcmp(src, back, len) != 0) {
+		fprintf(stderr, "len %d kind %d: round trip failed\n", len,
+			kind);
+		failed++;
+	}
+	/* the exact size fits, and nothing past it is written */
+	memset(out, 0xa5, sizeof(out));
+	if (lz_compress(src, len, out, n) != n || !guard_ok(out, n)) {
+		fprintf(stderr, "len %d kind %d: no fit in %d bytes\n", len,
+			kind, n);
+		failed++;
+	}
+	/* a byte less does not fit, and nothing past it is written */
+	memset(out, 0xa5, sizeof(out));
+	if (lz_compress(src, len, out, n - 1) != 0 || !guard_ok(out, n - 1)) {
+		fprintf(stderr, "len %d kind %d: overflowed %d bytes\n", len,
+			kind, n - 1);
+		failed++;
+	}
+}
+
+int
+main(int argc, const char *argv[])
+{
+	static char src[MAX_LEN];
+	int len, kind, tests = 0;
+
+	srandom(SEED);
+	for (kind = 0; kind < 4; kind++) {
+		/* every length around the nibble and 255 byte boundaries,
+		 * then some larger ones */
+		for (len = 0; len < 1200; len++, tests++) {
+			fill(src, len, kind);
+			check(src, len, kind);
+		}
+		for (len = 1200; len <= MAX_LEN; len += 997, tests++) {
+			fill(src, len, kind);
+			check(src, len, kind);
+		}
+	}
+	printf("lz: %d inputs, %d failed\n", tests, failed);
+	exit(failed > 0);
+}
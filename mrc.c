@@ -0,0 +1,304 @@
+/*
+ * mrc.c: online miss ratio curve estimation with SHARDS.
+ *
+ * The reuse distance of a request is the number of bytes in the distinct
+ * files requested since the last request for the same file. An LRU cache of
+ * size c hits exactly the requests whose distance plus their own size is at
+ * most c, so a histogram of distances gives the miss ratio of every cache
+ * size at once.
+ *
+ * Only files whose hashed name falls below a threshold are tracked, which
+ * samples files rather than requests, at rate R = threshold / MRC_P.
+ * Distances measured within the sample are scaled by 1 / R. The sample is
+ * kept to MRC_MAX_FILES files: when it grows beyond that, the file with the
+ * largest hash value is dropped and the threshold is lowered to that value
+ * (fixed-size SHARDS). Each sampled request counts with weight 1 / R, so
+ * requests sampled at a higher rate earlier count for less.
+ *
+ * Distances are computed with a Fenwick tree over logical times, holding
+ * the size of each tracked file at the time of its last request. Times are
+ * renumbered when they run out.
+ */
+
+#include "common.h"
+#include "mrc.h"
+
+#define MRC_P		(1U << 24)	/* hash values are below this */
+#define MRC_MAX_FILES	8192		/* files in the sample */
+#define MRC_TIMES	(4 * MRC_MAX_FILES)
+#define MRC_MIN_SIZE	4096		/* upper bound of the first bucket */
+#define MRC_STEPS	4		/* buckets per doubling of the size */
+#define MRC_BUCKETS	(MRC_STEPS * 40)
+
+struct mrc_file {
+	char *name;
+	unsigned int hval;
+	long size;
+	int time;		/* of the last request, 1 to MRC_TIMES */
+	int heap_idx;
+	struct mrc_file *hnext;
+};
+
+struct mrc {
+	unsigned int threshold;	/* files with a lower hash are sampled */
+	struct mrc_file *table[2 * MRC_MAX_FILES];
+	struct mrc_file *heap[MRC_MAX_FILES + 1]; /* max-heap on hval */
+	int nr_files;
+	long long tree[MRC_TIMES + 1];	/* Fenwick tree, indexed by time */
+	int clock;		/* last time handed out */
+	/* weight of requests by the bucket of their distance, bucket i
+	 * holds distances up to MRC_MIN_SIZE * 2^(i / MRC_STEPS) */
+	double hist[MRC_BUCKETS];
+	double cold;		/* weight of first requests for a file */
+	double total;
+	long long max_distance;
+	unsigned long requests;
+	unsigned long sampled;
+	pthread_mutex_t lock;
+};
+
+static unsigned int
+mrc_hash(const char *name)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *name++) != '\0')
+		hash = ((hash << 5) + hash) + c;
+	/* mix, so that the low bits depend on the whole name */
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdUL;
+	hash ^= hash >> 33;
+	return hash & (MRC_P - 1);
+}
+
+static void
+mrc_tree_add(struct mrc *m, int time, long long v)
+{
+	for (; time <= MRC_TIMES; time += time & -time)
+		m->tree[time] += v;
+}
+
+/* bytes in the files last requested at or before time */
+static long long
+mrc_tree_sum(struct mrc *m, int time)
+{
+	long long sum = 0;
+
+	for (; time > 0; time -= time & -time)
+		sum += m->tree[time];
+	return sum;
+}
+
+static void
+mrc_heap_swap(struct mrc *m, int a, int b)
+{
+	struct mrc_file *tmp = m->heap[a];
+
+	m->heap[a] = m->heap[b];
+	m->heap[b] = tmp;
+	m->heap[a]->heap_idx = a;
+	m->heap[b]->heap_idx = b;
+}
+
+static void
+mrc_heap_push(struct mrc *m, struct mrc_file *f)
+{
+	int i = m->nr_files++;
+
+	f->heap_idx = i;
+	m->heap[i] = f;
+	while (i > 0 && m->heap[(i - 1) / 2]->hval < m->heap[i]->hval) {
+		mrc_heap_swap(m, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static struct mrc_file *
+mrc_heap_pop(struct mrc *m)
+{
+	struct mrc_file *top = m->heap[0];
+	int i = 0, l, max;
+
+	mrc_heap_swap(m, 0, --m->nr_files);
+	while (1) {
+		l = 2 * i + 1;
+		max = i;
+		if (l < m->nr_files && m->heap[l]->hval > m->heap[max]->hval)
+			max = l;
+		if (l + 1 < m->nr_files &&
+		    m->heap[l + 1]->hval > m->heap[max]->hval)
+			max = l + 1;
+		if (max == i)
+			break;
+		mrc_heap_swap(m, i, max);
+		i = max;
+	}
+	return top;
+}
+
+static struct mrc_file **
+mrc_slot(struct mrc *m, const char *name, unsigned int hval)
+{
+	struct mrc_file **pp = &m->table[hval % (2 * MRC_MAX_FILES)];
+
+	while (*pp != NULL && strcmp((*pp)->name, name) != 0)
+		pp = &(*pp)->hnext;
+	return pp;
+}
+
+static int
+mrc_cmp_time(const void *a, const void *b)
+{
+	return (*(struct mrc_file **)a)->time - (*(struct mrc_file **)b)->time;
+}
+
+/* gives the tracked files the times 1 to nr_files, in the same order */
+static void
+mrc_renumber(struct mrc *m)
+{
+	struct mrc_file *files[MRC_MAX_FILES];
+	int i, n = m->nr_files;
+
+	memcpy(files, m->heap, n * sizeof(struct mrc_file *));
+	qsort(files, n, sizeof(struct mrc_file *), mrc_cmp_time);
+	memset(m->tree, 0, sizeof(m->tree));
+	for (i = 0; i < n; i++) {
+		files[i]->time = i + 1;
+		mrc_tree_add(m, i + 1, files[i]->size);
+	}
+	m->clock = n;
+}
+
+static int
+mrc_bucket(long long distance)
+{
+	int i;
+
+	if (distance <= MRC_MIN_SIZE)
+		return 0;
+	i = (int)ceil(MRC_STEPS * log2((double)distance / MRC_MIN_SIZE));
+	return i < MRC_BUCKETS ? i : MRC_BUCKETS - 1;
+}
+
+/* counts a request for name, which is size bytes long */
+void
+mrc_access(struct mrc *m, const char *name, long size)
+{
+	unsigned int hval = mrc_hash(name);
+	struct mrc_file **pp, *f;
+	double rate;
+	long long distance;
+
+	pthread_mutex_lock(&m->lock);
+	m->requests++;
+	if (hval >= m->threshold) {
+		pthread_mutex_unlock(&m->lock);
+		return;
+	}
+	m->sampled++;
+	rate = (double)m->threshold / MRC_P;
+	m->total += 1 / rate;
+	if (m->clock == MRC_TIMES)
+		mrc_renumber(m);
+
+	pp = mrc_slot(m, name, hval);
+	if ((f = *pp) != NULL) {
+		distance = mrc_tree_sum(m, m->clock) -
+			mrc_tree_sum(m, f->time);
+		distance = distance / rate + size;
+		if (distance > m->max_distance)
+			m->max_distance = distance;
+		m->hist[mrc_bucket(distance)] += 1 / rate;
+		mrc_tree_add(m, f->time, -f->size);
+	} else {
+		m->cold += 1 / rate;
+		f = Malloc(sizeof(struct mrc_file));
+		f->name = strdup(name);
+		f->hval = hval;
+		f->hnext = NULL;
+		*pp = f;
+		mrc_heap_push(m, f);
+	}
+	f->size = size;
+	f->time = ++m->clock;
+	mrc_tree_add(m, f->time, size);
+
+	/* too many files, sample fewer */
+	while (m->nr_files > MRC_MAX_FILES) {
+		f = mrc_heap_pop(m);
+		m->threshold = f->hval;
+		mrc_tree_add(m, f->time, -f->size);
+		*mrc_slot(m, f->name, f->hval) = f->hnext;
+		free(f->name);
+		free(f);
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+/* estimated miss ratio of an LRU cache of cache_size bytes */
+double
+mrc_miss_ratio(struct mrc *m, long long cache_size)
+{
+	double misses;
+	int i;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->total == 0) {
+		pthread_mutex_unlock(&m->lock);
+		return 0;
+	}
+	/* requests in buckets above cache_size miss. in the bucket that
+	 * cache_size falls in, distances are taken to be spread evenly on a
+	 * log scale. */
+	misses = m->cold;
+	for (i = 0; i < MRC_BUCKETS; i++) {
+		double hi = MRC_MIN_SIZE * pow(2, (double)i / MRC_STEPS);
+		double lo = i == 0 ? 0 : hi / pow(2, 1.0 / MRC_STEPS);
+
+		if (lo >= cache_size)
+			misses += m->hist[i];
+		else if (hi > cache_size)
+			misses += m->hist[i] * (i == 0 ? 1 - cache_size / hi :
+				MRC_STEPS * log2(hi / cache_size));
+	}
+	misses /= m->total;
+	pthread_mutex_unlock(&m->lock);
+	return misses;
+}
+
+struct mrc *
+mrc_init(void)
+{
+	struct mrc *m;
+
+	m = Malloc(sizeof(struct mrc));
+	memset(m, 0, sizeof(struct mrc));
+	m->threshold = MRC_P;
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+void
+mrc_destroy(struct mrc *m)
+{
+	int i;
+
+	for (i = 0; i < m->nr_files; i++) {
+		free(m->heap[i]->name);
+		free(m->heap[i]);
+	}
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+void
+mrc_get_stats(struct mrc *m, struct mrc_stats *stats)
+{
+	pthread_mutex_lock(&m->lock);
+	stats->requests = m->requests;
+	stats->sampled = m->sampled;
+	stats->rate = (double)m->threshold / MRC_P;
+	stats->max_distance = m->max_distance;
+	pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,25 @@
+#ifndef __MRC_H__
+#define __MRC_H__
+
+/*
+ * mrc.c: estimates the miss ratio curve of the request stream, i.e. the
+ * miss ratio an LRU cache of each size would have, from a sample of the
+ * requests (SHARDS).
+ */
+
+struct mrc;
+
+struct mrc_stats {
+	unsigned long requests;	/* requests seen */
+	unsigned long sampled;	/* of those, requests in the sample */
+	double rate;		/* current sampling rate */
+	long long max_distance;	/* largest reuse distance seen, in bytes */
+};
+
+struct mrc *mrc_init(void);
+void mrc_destroy(struct mrc *m);
+void mrc_access(struct mrc *m, const char *name, long size);
+double mrc_miss_ratio(struct mrc *m, long long cache_size);
+void mrc_get_stats(struct mrc *m, struct mrc_stats *stats);
+
+#endif /* __MRC_H__ */
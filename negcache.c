@@ -0,0 +1,230 @@
+/*
+ * negcache.c: cache of error responses for files that could not be served.
+ *
+ * Broken links and scanners ask for the same missing files over and over,
+ * and each of those requests would otherwise stat() the file and format the
+ * error page again. Here the whole response is kept, so a repeated request
+ * is a hash lookup and a copy.
+ *
+ * Every entry lives for the same ttl, so the order in which entries were
+ * inserted is also the order in which they expire. Entries are kept on a
+ * list in that order, and expired entries are dropped from its head. When
+ * the cache is full the oldest entry makes room. Entries are also dropped
+ * when the change watcher reports that the file, or a directory above it,
+ * changed.
+ */
+
+#include "common.h"
+#include "negcache.h"
+#include <time.h>
+
+struct neg_entry {
+	struct neg_entry *hnext;	/* in its hash bucket */
+	struct neg_entry *prev;		/* in insertion order */
+	struct neg_entry *next;
+	double expires;
+	int size;			/* of the response */
+	char *response;
+	char name[];
+};
+
+struct negcache {
+	struct neg_entry **buckets;
+	unsigned long nr_buckets;
+	struct neg_entry *oldest;
+	struct neg_entry *newest;
+	int nr_entries;
+	int max_entries;
+	double ttl;			/* seconds */
+	pthread_mutex_t lock;
+	struct negcache_stats stats;
+};
+
+static unsigned long
+negcache_hash(struct negcache *nc, const char *name)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *name++) != '\0')
+		hash = ((hash << 5) + hash) + c;
+	return hash & (nc->nr_buckets - 1);
+}
+
+static double
+negcache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct negcache *
+negcache_init(int max_entries, double ttl)
+{
+	struct negcache *nc;
+
+	nc = Malloc(sizeof(struct negcache));
+	memset(nc, 0, sizeof(struct negcache));
+	nc->max_entries = max_entries > 0 ? max_entries : 1;
+	nc->ttl = ttl;
+	nc->nr_buckets = 64;
+	while (nc->nr_buckets < nc->max_entries)
+		nc->nr_buckets <<= 1;
+	nc->buckets = Malloc(nc->nr_buckets * sizeof(struct neg_entry *));
+	memset(nc->buckets, 0, nc->nr_buckets * sizeof(struct neg_entry *));
+	pthread_mutex_init(&nc->lock, NULL);
+	return nc;
+}
+
+void
+negcache_destroy(struct negcache *nc)
+{
+	struct neg_entry *e;
+
+	while ((e = nc->oldest) != NULL) {
+		nc->oldest = e->next;
+		free(e);
+	}
+	free(nc->buckets);
+	pthread_mutex_destroy(&nc->lock);
+	free(nc);
+}
+
+static struct neg_entry *
+negcache_find(struct negcache *nc, const char *name)
+{
+	struct neg_entry *e;
+
+	for (e = nc->buckets[negcache_hash(nc, name)]; e; e = e->hnext) {
+		if (strcmp(e->name, name) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static void
+negcache_unlink(struct negcache *nc, struct neg_entry *e)
+{
+	struct neg_entry **pp = &nc->buckets[negcache_hash(nc, e->name)];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		nc->oldest = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		nc->newest = e->prev;
+	nc->nr_entries--;
+	free(e);
+}
+
+static void
+negcache_expire(struct negcache *nc, double now)
+{
+	while (nc->oldest != NULL && nc->oldest->expires <= now) {
+		negcache_unlink(nc, nc->oldest);
+		nc->stats.expired++;
+	}
+}
+
+/* copies the response for name to buf, which has room for max bytes, and
+ * returns its length. returns 0 if name is not cached. */
+int
+negcache_lookup(struct negcache *nc, const char *name, char *buf, size_t max)
+{
+	struct neg_entry *e;
+	int size = 0;
+
+	pthread_mutex_lock(&nc->lock);
+	negcache_expire(nc, negcache_now());
+	e = negcache_find(nc, name);
+	if (e != NULL && e->size <= max) {
+		memcpy(buf, e->response, e->size);
+		size = e->size;
+		nc->stats.hits++;
+	}
+	pthread_mutex_unlock(&nc->lock);
+	return size;
+}
+
+/* remembers the response that was sent for name */
+void
+negcache_insert(struct negcache *nc, const char *name, const char *buf,
+		int size)
+{
+	size_t len = strlen(name) + 1;
+	struct neg_entry *e, *old;
+	unsigned long h;
+	double now;
+
+	e = Malloc(sizeof(struct neg_entry) + len + size);
+	memcpy(e->name, name, len);
+	e->response = e->name + len;
+	memcpy(e->response, buf, size);
+	e->size = size;
+
+	pthread_mutex_lock(&nc->lock);
+	now = negcache_now();
+	e->expires = now + nc->ttl;
+	negcache_expire(nc, now);
+	if ((old = negcache_find(nc, name)) != NULL)
+		negcache_unlink(nc, old);
+	if (nc->nr_entries == nc->max_entries) {
+		negcache_unlink(nc, nc->oldest);
+		nc->stats.evicted++;
+	}
+	h = negcache_hash(nc, name);
+	e->hnext = nc->buckets[h];
+	nc->buckets[h] = e;
+	e->prev = nc->newest;
+	e->next = NULL;
+	if (nc->newest)
+		nc->newest->next = e;
+	else
+		nc->oldest = e;
+	nc->newest = e;
+	nc->nr_entries++;
+	nc->stats.inserts++;
+	pthread_mutex_unlock(&nc->lock);
+}
+
+/* forgets path, or with tree everything at or below path */
+void
+negcache_remove(struct negcache *nc, const char *path, int tree)
+{
+	struct neg_entry *e, *next;
+	size_t len = strlen(path);
+
+	pthread_mutex_lock(&nc->lock);
+	if (!tree) {
+		if ((e = negcache_find(nc, path)) != NULL) {
+			negcache_unlink(nc, e);
+			nc->stats.invalidated++;
+		}
+	} else {
+		for (e = nc->oldest; e; e = next) {
+			next = e->next;
+			if (strcmp(path, ".") == 0 ||
+			    (strncmp(e->name, path, len) == 0 &&
+			     (e->name[len] == '\0' || e->name[len] == '/'))) {
+				negcache_unlink(nc, e);
+				nc->stats.invalidated++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&nc->lock);
+}
+
+void
+negcache_get_stats(struct negcache *nc, struct negcache_stats *stats)
+{
+	pthread_mutex_lock(&nc->lock);
+	*stats = nc->stats;
+	pthread_mutex_unlock(&nc->lock);
+}
@@ -0,0 +1,31 @@
+#ifndef __NEGCACHE_H__
+#define __NEGCACHE_H__
+
+/*
+ * negcache.c: remembers the error responses for files that could not be
+ * served (404 and 403), so that repeated requests for them are answered
+ * without looking at the disk again.
+ */
+
+#include <stddef.h>
+
+struct negcache;
+
+struct negcache_stats {
+	unsigned long hits;
+	unsigned long inserts;
+	unsigned long expired;	   /* entries that outlived the ttl */
+	unsigned long evicted;	   /* entries dropped to make room */
+	unsigned long invalidated; /* entries dropped because files changed */
+};
+
+struct negcache *negcache_init(int max_entries, double ttl);
+void negcache_destroy(struct negcache *nc);
+int negcache_lookup(struct negcache *nc, const char *name, char *buf,
+		    size_t max);
+void negcache_insert(struct negcache *nc, const char *name, const char *buf,
+		     int size);
+void negcache_remove(struct negcache *nc, const char *path, int tree);
+void negcache_get_stats(struct negcache *nc, struct negcache_stats *stats);
+
+#endif /* __NEGCACHE_H__ */
@@ -0,0 +1,312 @@
+/*
+ * prefetch.c: loads files into the cache before they are requested.
+ *
+ * The model is first order: for each file it counts which files the same
+ * client asked for next, and when a file is requested, successors that
+ * followed it often enough are queued for loading. Both tables are direct
+ * mapped and fixed in size, a file or client that hashes to a taken slot
+ * simply replaces what was there, so the model never grows. Counts are
+ * halved once a file has been seen often, so that old habits fade.
+ *
+ * One thread loads the queued files through a callback, no faster than the
+ * bandwidth allows. The queue is small and predictions that don't fit are
+ * dropped, prefetching is only worth it while it keeps ahead of the client.
+ */
+
+#include "common.h"
+#include "prefetch.h"
+#include <time.h>
+
+#define PF_FILES	65536	/* files the model remembers */
+#define PF_CLIENTS	4096	/* clients whose last request is remembered */
+#define PF_SUCCS	4	/* successors remembered per file */
+#define PF_QUEUE	64	/* files waiting to be loaded */
+#define PF_MIN_COUNT	2	/* times a successor is seen before it is used */
+#define PF_MIN_PROB	0.25	/* share of the transitions it must have */
+#define PF_MAX_TOTAL	256	/* transitions after which counts are halved */
+
+struct pf_succ {
+	char *name;
+	int count;
+};
+
+struct pf_file {
+	char *name;
+	int total;		/* sum of the successor counts */
+	struct pf_succ succ[PF_SUCCS];
+};
+
+struct pf_client {
+	unsigned long id;
+	char *last;		/* last file this client asked for */
+	size_t last_max;	/* bytes last has room for */
+};
+
+struct prefetch {
+	struct pf_file *files;
+	struct pf_client *clients;
+	char *queue[PF_QUEUE];
+	int head;		/* oldest queued file */
+	int count;
+	long bandwidth;		/* bytes per second, 0 for no limit */
+	double ready;		/* time when the budget allows the next read */
+	int stopping;
+	prefetch_fn load;
+	void *arg;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct prefetch_stats stats;
+};
+
+static unsigned long
+prefetch_hash(const char *name)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *name++) != '\0')
+		hash = ((hash << 5) + hash) + c;
+	return hash;
+}
+
+static double
+prefetch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+prefetch_forget(struct pf_file *f)
+{
+	int i;
+
+	free(f->name);
+	for (i = 0; i < PF_SUCCS; i++) {
+		free(f->succ[i].name);
+	}
+	memset(f, 0, sizeof(struct pf_file));
+}
+
+/* returns the slot of name, or NULL if another file has taken it */
+static struct pf_file *
+prefetch_find(struct prefetch *pf, const char *name)
+{
+	struct pf_file *f = &pf->files[prefetch_hash(name) & (PF_FILES - 1)];
+
+	if (f->name == NULL || strcmp(f->name, name) != 0)
+		return NULL;
+	return f;
+}
+
+/* counts one request for next right after one for prev */
+static void
+prefetch_learn(struct prefetch *pf, const char *prev, const char *next)
+{
+	struct pf_file *f = &pf->files[prefetch_hash(prev) & (PF_FILES - 1)];
+	struct pf_succ *s = NULL;
+	int i;
+
+	if (f->name == NULL || strcmp(f->name, prev) != 0) {
+		prefetch_forget(f);
+		f->name = strdup(prev);
+	}
+	for (i = 0; i < PF_SUCCS; i++) {
+		if (f->succ[i].name && strcmp(f->succ[i].name, next) == 0) {
+			s = &f->succ[i];
+			break;
+		}
+		/* otherwise replace the least frequent successor */
+		if (s == NULL || f->succ[i].count < s->count)
+			s = &f->succ[i];
+	}
+	if (s->name == NULL || strcmp(s->name, next) != 0) {
+		f->total -= s->count;
+		free(s->name);
+		s->name = strdup(next);
+		s->count = 0;
+	}
+	s->count++;
+	f->total++;
+
+	if (f->total > PF_MAX_TOTAL) {
+		f->total = 0;
+		for (i = 0; i < PF_SUCCS; i++) {
+			f->succ[i].count /= 2;
+			f->total += f->succ[i].count;
+		}
+	}
+}
+
+/* queues the likely successors of name */
+static void
+prefetch_predict(struct prefetch *pf, const char *name)
+{
+	struct pf_file *f = prefetch_find(pf, name);
+	struct pf_succ *s;
+	int i, j;
+
+	if (f == NULL)
+		return;
+	for (i = 0; i < PF_SUCCS; i++) {
+		s = &f->succ[i];
+		if (s->name == NULL || s->count < PF_MIN_COUNT ||
+		    s->count < PF_MIN_PROB * f->total)
+			continue;
+		for (j = 0; j < pf->count; j++) {
+			if (strcmp(pf->queue[(pf->head + j) % PF_QUEUE],
+				   s->name) == 0)
+				break;
+		}
+		if (j < pf->count)
+			continue;	/* already queued */
+		if (pf->count == PF_QUEUE) {
+			pf->stats.dropped++;
+			continue;
+		}
+		pf->queue[(pf->head + pf->count++) % PF_QUEUE] =
+			strdup(s->name);
+		pf->stats.predictions++;
+		pthread_cond_signal(&pf->wake);
+	}
+}
+
+/* called for every request, client identifies where it came from */
+void
+prefetch_access(struct prefetch *pf, unsigned long client, const char *name)
+{
+	struct pf_client *c = &pf->clients[client % PF_CLIENTS];
+	size_t len = strlen(name) + 1;
+
+	pthread_mutex_lock(&pf->lock);
+	pf->stats.accesses++;
+	if (c->last != NULL && c->id == client && strcmp(c->last, name) != 0)
+		prefetch_learn(pf, c->last, name);
+	/* keep the buffer if the name fits, this is done for every request */
+	if (len > c->last_max) {
+		free(c->last);
+		c->last = Malloc(len);
+		c->last_max = len;
+	}
+	memcpy(c->last, name, len);
+	c->id = client;
+	prefetch_predict(pf, name);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+static void *
+prefetch_main(void *arg)
+{
+	struct prefetch *pf = arg;
+	struct timespec ts;
+	double now;
+	long bytes;
+	char *name;
+
+	pthread_mutex_lock(&pf->lock);
+	while (1) {
+		while (!pf->stopping && pf->count == 0) {
+			pthread_cond_wait(&pf->wake, &pf->lock);
+		}
+		if (pf->stopping)
+			break;
+		name = pf->queue[pf->head];
+		pf->head = (pf->head + 1) % PF_QUEUE;
+		pf->count--;
+		pthread_mutex_unlock(&pf->lock);
+
+		bytes = pf->load(pf->arg, name);
+		free(name);
+
+		pthread_mutex_lock(&pf->lock);
+		if (bytes <= 0)
+			continue;
+		pf->stats.loads++;
+		pf->stats.bytes += bytes;
+		if (pf->bandwidth == 0)
+			continue;
+		now = prefetch_now();
+		if (pf->ready < now)
+			pf->ready = now;
+		pf->ready += (double)bytes / pf->bandwidth;
+		ts.tv_sec = (time_t)pf->ready;
+		ts.tv_nsec = (long)((pf->ready - ts.tv_sec) * 1e9);
+		while (!pf->stopping && prefetch_now() < pf->ready) {
+			pthread_cond_timedwait(&pf->wake, &pf->lock, &ts);
+		}
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return NULL;
+}
+
+struct prefetch *
+prefetch_init(long bandwidth, prefetch_fn load, void *arg)
+{
+	struct prefetch *pf;
+	pthread_condattr_t attr;
+
+	pf = Malloc(sizeof(struct prefetch));
+	memset(pf, 0, sizeof(struct prefetch));
+	pf->files = Malloc(PF_FILES * sizeof(struct pf_file));
+	memset(pf->files, 0, PF_FILES * sizeof(struct pf_file));
+	pf->clients = Malloc(PF_CLIENTS * sizeof(struct pf_client));
+	memset(pf->clients, 0, PF_CLIENTS * sizeof(struct pf_client));
+	pf->bandwidth = bandwidth;
+	pf->load = load;
+	pf->arg = arg;
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pf->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	SYS(pthread_create(&pf->thread, NULL, prefetch_main, pf));
+	return pf;
+}
+
+/* stops loading files, requests are still learnt from */
+void
+prefetch_stop(struct prefetch *pf)
+{
+	pthread_mutex_lock(&pf->lock);
+	if (pf->stopping) {
+		pthread_mutex_unlock(&pf->lock);
+		return;
+	}
+	pf->stopping = 1;
+	pthread_cond_signal(&pf->wake);
+	pthread_mutex_unlock(&pf->lock);
+	pthread_join(pf->thread, NULL);
+}
+
+void
+prefetch_destroy(struct prefetch *pf)
+{
+	int i;
+
+	prefetch_stop(pf);
+	for (i = 0; i < pf->count; i++) {
+		free(pf->queue[(pf->head + i) % PF_QUEUE]);
+	}
+	for (i = 0; i < PF_FILES; i++) {
+		prefetch_forget(&pf->files[i]);
+	}
+	for (i = 0; i < PF_CLIENTS; i++) {
+		free(pf->clients[i].last);
+	}
+	free(pf->files);
+	free(pf->clients);
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->wake);
+	free(pf);
+}
+
+void
+prefetch_get_stats(struct prefetch *pf, struct prefetch_stats *stats)
+{
+	pthread_mutex_lock(&pf->lock);
+	*stats = pf->stats;
+	pthread_mutex_unlock(&pf->lock);
+}
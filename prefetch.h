@@ -0,0 +1,29 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+/*
+ * prefetch.c: learns which file each client tends to ask for after another
+ * one, and loads the likely next files into the cache in the background.
+ */
+
+/* loads path, returns the number of bytes read from the disk */
+typedef long (*prefetch_fn)(void *arg, const char *path);
+
+struct prefetch;
+
+struct prefetch_stats {
+	unsigned long accesses;	  /* requests the model learnt from */
+	unsigned long predictions;/* files queued for loading */
+	unsigned long dropped;	  /* predictions the queue had no room for */
+	unsigned long loads;	  /* files the callback read */
+	unsigned long long bytes; /* bytes the callback read */
+};
+
+struct prefetch *prefetch_init(long bandwidth, prefetch_fn load, void *arg);
+void prefetch_stop(struct prefetch *pf);
+void prefetch_destroy(struct prefetch *pf);
+void prefetch_access(struct prefetch *pf, unsigned long client,
+		     const char *name);
+void prefetch_get_stats(struct prefetch *pf, struct prefetch_stats *stats);
+
+#endif /* __PREFETCH_H__ */
@@ -0,0 +1,314 @@
+/*
+ * pressure.c: adapts the cache budget to the memory available.
+ *
+ * Once every PRESSURE_INTERVAL seconds a thread reads memory.current,
+ * memory.max and memory.stat of the cgroup the server runs in (cgroup v2),
+ * and the PSI memory stall time, from the cgroup's memory.pressure or else
+ * /proc/pressure/memory. Inactive file pages count as free, since the
+ * kernel drops them before anything else when the cgroup hits its limit.
+ *
+ * If tasks stalled on memory for more than PRESSURE_STALL_HIGH of the last
+ * interval, or less than a tenth of the limit is free, the budget shrinks
+ * by a quarter. If there was (almost) no stall and more than a fifth of the
+ * limit is free, it grows by a 32nd of the range between its bounds, but by
+ * no more than half of what is free. Shrinking fast and growing slowly keeps
+ * the server from being OOM-killed when a co-tenant grows, without giving
+ * up memory for good at every blip.
+ *
+ * The new budget goes to a callback, which makes the cache keep to it.
+ * Whatever can't be read is left out: without a cgroup only stalls count,
+ * and without either the budget stays where it started, at its upper bound.
+ */
+
+#include "common.h"
+#include "pressure.h"
+#include <time.h>
+
+#define PRESSURE_INTERVAL	1.0	/* seconds between readings */
+#define PRESSURE_STALL_HIGH	0.10	/* of the interval, shrink above */
+#define PRESSURE_STALL_LOW	0.01	/* grow only below */
+
+struct pressure {
+	long min;
+	long max;
+	long budget;
+	char cgroup[MAXLINE];	/* directory of the cgroup, "" if none */
+	char psi[2 * MAXLINE];	/* file with the stall times, "" if none */
+	long long stall_total;	/* microseconds stalled, at the last reading */
+	int stopping;
+	pressure_fn fn;
+	void *arg;
+	pthread_t thread;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/* signalled by pressure_stop */
+	struct pressure_stats stats;
+};
+
+static double
+pressure_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* reads the number in file, or -1 for "max". returns 0 if it can't. */
+static int
+pressure_read(const char *dir, const char *file, long long *v)
+{
+	char path[2 * MAXLINE], buf[64];
+	FILE *f;
+	int ok = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), f) != NULL) {
+		if (strncmp(buf, "max", 3) == 0) {
+			*v = -1;
+			ok = 1;
+		} else {
+			ok = sscanf(buf, "%lld", v) == 1;
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+/* reads the value of key from a file of "key value" lines */
+static int
+pressure_read_key(const char *dir, const char *file, const char *key,
+		  long long *v)
+{
+	char path[2 * MAXLINE], line[MAXLINE], name[64];
+	long long value;
+	FILE *f;
+	int ok = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	while (!ok && fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%63s %lld", name, &value) == 2 &&
+		    strcmp(name, key) == 0) {
+			*v = value;
+			ok = 1;
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+/* reads the total time stalled from the "some" line of a PSI file */
+static int
+pressure_read_psi(const char *path, long long *total)
+{
+	char line[MAXLINE], *p;
+	FILE *f;
+	int ok = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	while (!ok && fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "some ", 5) == 0 &&
+		    (p = strstr(line, "total=")) != NULL)
+			ok = sscanf(p + 6, "%lld", total) == 1;
+	}
+	fclose(f);
+	return ok;
+}
+
+/* finds the directory of our cgroup in the cgroup2 hierarchy, from the
+ * "0::<path>" line of /proc/self/cgroup and the mount point in mountinfo */
+static void
+pressure_find_cgroup(struct pressure *p)
+{
+	char line[MAXLINE], mount[MAXLINE] = "", path[MAXLINE] = "";
+	char *sep, *field, *save;
+	long long v;
+	FILE *f;
+	int i;
+
+	if ((f = fopen("/proc/self/cgroup", "r")) != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (strncmp(line, "0::", 3) == 0) {
+				line[strcspn(line, "\n")] = '\0';
+				snprintf(path, sizeof(path), "%s", line + 3);
+			}
+		}
+		fclose(f);
+	}
+	/* "<id> <parent> <dev> <root> <mount point> ... - cgroup2 ..." */
+	if ((f = fopen("/proc/self/mountinfo", "r")) != NULL) {
+		while (mount[0] == '\0' && fgets(line, sizeof(line), f)) {
+			if ((sep = strstr(line, " - cgroup2 ")) == NULL)
+				continue;
+			field = strtok_r(line, " ", &save);
+			for (i = 0; field != NULL && i < 4; i++)
+				field = strtok_r(NULL, " ", &save);
+			if (field != NULL)
+				snprintf(mount, sizeof(mount), "%s", field);
+		}
+		fclose(f);
+	}
+	if (mount[0] == '\0' || path[0] == '\0')
+		return;
+	/* a directory whose name doesn't fit can't be read either */
+	if (snprintf(p->cgroup, sizeof(p->cgroup), "%s%s", mount,
+		     strcmp(path, "/") == 0 ? "" : path) >= sizeof(p->cgroup)) {
+		p->cgroup[0] = '\0';
+		return;
+	}
+	/* the root cgroup has no memory.current */
+	if (!pressure_read(p->cgroup, "memory.current", &v))
+		p->cgroup[0] = '\0';
+}
+
+/* takes a reading and moves the budget. called with the lock held. */
+static void
+pressure_sample(struct pressure *p)
+{
+	long long current, limit = -1, inactive = 0, total, room = -1;
+	double stall = 0;
+	long budget = p->budget, step;
+	int have_cgroup, have_psi;
+
+	have_cgroup = p->cgroup[0] != '\0' &&
+		pressure_read(p->cgroup, "memory.current", &current) &&
+		pressure_read(p->cgroup, "memory.max", &limit);
+	if (have_cgroup && limit > 0) {
+		pressure_read_key(p->cgroup, "memory.stat", "inactive_file",
+				  &inactive);
+		room = limit - current + inactive;
+	}
+	have_psi = p->psi[0] != '\0' && pressure_read_psi(p->psi, &total);
+	if (have_psi) {
+		if (p->stall_total >= 0)
+			stall = (total - p->stall_total) /
+				(PRESSURE_INTERVAL * 1e6);
+		p->stall_total = total;
+	}
+	p->stats.samples++;
+	p->stats.cgroup = have_cgroup;
+	p->stats.psi = have_psi;
+
+	if (stall > PRESSURE_STALL_HIGH || (room >= 0 && room < limit / 10)) {
+		budget -= budget / 4;
+		if (budget < p->min)
+			budget = p->min;
+	} else if ((have_psi || room >= 0) && stall < PRESSURE_STALL_LOW &&
+		   (room < 0 || room > limit / 5)) {
+		step = (p->max - p->min) / 32;
+		if (step < 1)
+			step = 1;
+		if (room >= 0 && step > room / 2)
+			step = room / 2;
+		budget += step;
+		if (budget > p->max)
+			budget = p->max;
+	}
+	if (budget == p->budget)
+		return;
+	if (budget < p->budget)
+		p->stats.shrinks++;
+	else
+		p->stats.grows++;
+	p->budget = budget;
+	p->stats.budget = budget;
+	if (budget < p->stats.lowest)
+		p->stats.lowest = budget;
+	p->fn(p->arg, budget);
+}
+
+static void *
+pressure_main(void *arg)
+{
+	struct pressure *p = arg;
+	struct timespec ts;
+	double t;
+
+	pthread_mutex_lock(&p->lock);
+	t = pressure_now();
+	while (!p->stopping) {
+		t += PRESSURE_INTERVAL;
+		ts.tv_sec = (time_t)t;
+		ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+		while (!p->stopping && pressure_now() < t)
+			pthread_cond_timedwait(&p->wake, &p->lock, &ts);
+		if (!p->stopping)
+			pressure_sample(p);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* starts adapting a budget between min and max bytes, starting at max */
+struct pressure *
+pressure_start(long min, long max, pressure_fn fn, void *arg)
+{
+	struct pressure *p;
+	pthread_condattr_t attr;
+	char path[2 * MAXLINE];
+	long long total;
+
+	p = Malloc(sizeof(struct pressure));
+	memset(p, 0, sizeof(struct pressure));
+	p->min = min < max ? min : max;
+	p->max = max;
+	p->budget = max;
+	p->stats.budget = max;
+	p->stats.lowest = max;
+	p->stall_total = -1;
+	p->fn = fn;
+	p->arg = arg;
+	pressure_find_cgroup(p);
+	snprintf(path, sizeof(path), "%s/memory.pressure", p->cgroup);
+	if (p->cgroup[0] != '\0' && pressure_read_psi(path, &total))
+		snprintf(p->psi, sizeof(p->psi), "%s", path);
+	else if (pressure_read_psi("/proc/pressure/memory", &total))
+		snprintf(p->psi, sizeof(p->psi), "/proc/pressure/memory");
+	if (p->cgroup[0] == '\0' && p->psi[0] == '\0')
+		fprintf(stderr, "%s: no cgroup v2 memory controller and no "
+			"PSI, the cache budget stays fixed\n", __FUNCTION__);
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	SYS(pthread_create(&p->thread, NULL, pressure_main, p));
+	p->running = 1;
+	return p;
+}
+
+/* stops adapting the budget, and waits for the thread */
+void
+pressure_stop(struct pressure *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stopping = 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	if (p->running)
+		pthread_join(p->thread, NULL);
+	p->running = 0;
+}
+
+void
+pressure_destroy(struct pressure *p)
+{
+	pressure_stop(p);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->wake);
+	free(p);
+}
+
+void
+pressure_get_stats(struct pressure *p, struct pressure_stats *stats)
+{
+	pthread_mutex_lock(&p->lock);
+	*stats = p->stats;
+	pthread_mutex_unlock(&p->lock);
+}
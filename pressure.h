@@ -0,0 +1,30 @@
+#ifndef __PRESSURE_H__
+#define __PRESSURE_H__
+
+/*
+ * pressure.c: adapts the cache budget to the memory the server can use,
+ * from the cgroup (v2) it runs in and from PSI memory pressure readings.
+ */
+
+/* the cache should now keep to budget bytes */
+typedef void (*pressure_fn)(void *arg, long budget);
+
+struct pressure;
+
+struct pressure_stats {
+	unsigned long samples;	/* readings taken */
+	unsigned long shrinks;	/* times the budget went down */
+	unsigned long grows;	/* and up */
+	long budget;		/* the current budget */
+	long lowest;		/* the lowest budget so far */
+	int cgroup;		/* memory.current and memory.max were read */
+	int psi;		/* stall times were read */
+};
+
+struct pressure *pressure_start(long min, long max, pressure_fn fn,
+				void *arg);
+void pressure_stop(struct pressure *p);
+void pressure_destroy(struct pressure *p);
+void pressure_get_stats(struct pressure *p, struct pressure_stats *stats);
+
+#endif /* __PRESSURE_H__ */
@@ -4,20 +4,112 @@
 
 #include "common.h"
 #include "request.h"
+#include "arena.h"
+#include "http.h"
+#include "accesslog.h"
+#include <limits.h>
+#include <sys/sendfile.h>
+
+#define REQUEST_MAX_RANGES 16	/* with more, the whole file is sent */
+#define REQUEST_CHUNK (64 * 1024) /* read and sent at a time when streaming */
+#define REQUEST_ETAG 80	/* bytes for a tag from request_etag */
+
+/* the precompressed copies, in the order they are preferred in */
+static const struct {
+	int enc;
+	const char *ext;	/* of the copy, after the file name */
+	const char *name;	/* in Accept-Encoding and Content-Encoding */
+} request_encodings[] = {
+	{ FILE_ENC_BR, ".br", "br" },
+	{ FILE_ENC_GZ, ".gz", "gzip" },
+};
+
+#define NR_ENCODINGS \
+	(sizeof(request_encodings) / sizeof(request_encodings[0]))
 
 struct request {
 	int fd;		 /* descriptor for client connection */
 	struct file_data *data;
+	int status;	 /* HTTP status if request_readfile failed, or 0 */
+	const char *why; /* and the message for the client */
+	struct http_parser http; /* slices of buf */
+	size_t len;	 /* bytes read into buf */
+	char buf[MAXBUF];
+	/* the parts of the body to send, set by request_send_header. with
+	 * none, the whole body is sent. */
+	long range_start[REQUEST_MAX_RANGES];
+	long range_len[REQUEST_MAX_RANGES];
+	int nr_ranges;
+	char boundary[40]; /* between the parts, if there are several */
+	int file_fd;	 /* the file, while request_sendfile_disk sends it */
+	int encoding;	 /* FILE_ENC_* copy being sent instead, or 0 */
+	int chunked;	 /* the body is sent in chunks, then a trailer */
+	int aborted;	 /* see request_abort */
+	/* for the access log */
+	long long start; /* when the request was taken up */
+	int sent_status; /* of the response sent, or 0 */
+	long sent_bytes;
+	const char *cache; /* how it was served, see request_set_cache */
+	/* what request_stat_encodings found out about the file and its
+	 * copies, so that request_findfile doesn't stat them again */
+	int stat_known;	 /* the fields below are set */
+	int stat_status; /* of request_checkfile on the file */
+	const char *stat_why;
+	struct stat stat_file;
+	int stat_encodings; /* the copies that were found */
+	struct stat stat_copies[NR_ENCODINGS]; /* of those */
+	char chunk[REQUEST_CHUNK]; /* for request_streamfile */
 };
 
-/* requestError(fd, filename, "404", "Not found", 
- *		"OS server could not find this file");
- */
+static void request_preparefile(struct file_data *data);
+static int request_processfile(const char *buf, long size);
+static void request_streamfile(struct request *rq, request_chunk_fn chunk,
+			      void *arg);
+static unsigned int request_csum(const char *buf, long size,
+				 unsigned int csum);
+static int request_checkfile(struct file_data *data, struct stat *sbuf,
+			     const char **why);
+
+/* each thread keeps the request it finished with last and reuses it for the
+ * next one, so that the buffer isn't allocated and faulted in every time */
+static pthread_key_t request_key;
+static pthread_once_t request_once = PTHREAD_ONCE_INIT;
+
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_key_init(void)
 {
-	char buf[MAXLINE], body[MAXBUF];
-	int i;
+	pthread_key_create(&request_key, free);
+}
+
+/* where finished requests are logged, or NULL */
+static struct accesslog *request_access_log;
+
+/* logs every request to log from now on */
+void
+request_set_log(struct accesslog *log)
+{
+	request_access_log = log;
+}
+
+/* sends n bytes of buf to the client, counting them for the log */
+static void
+request_write(struct request *rq, void *buf, size_t n)
+{
+	if (rq->aborted)
+		return;
+	Rio_write(rq->fd, buf, n);
+	rq->sent_bytes += n;
+}
+
+/* builds the whole response for an error into buf, which has room for max
+ * bytes, and returns its length, or 0 if it does not fit */
+static int
+request_build_error(char *buf, size_t max, char *cause, char *errnum,
+		    char *shortmsg, char *longmsg)
+{
+	char body[2 * MAXBUF];
+	size_t len;
+	int i, size;
 	unsigned int csum = 0;
 
 	/* create the body of the error message */
@@ -27,72 +119,110 @@ request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", longmsg, cause);
 	sprintf(body + strlen(body), "</body></html>\r\n");
 
-	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
-
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
-
-	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	len = strlen(body);
 
 	/* generate a very trivial checksum */
-	for (i = 0; i < strlen(body); i++) {
+	for (i = 0; i < len; i++) {
 		csum += (unsigned char)(body[i]);
 	}
-	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
-
-	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
 
+	/* the header information for this response, then the content */
+	size = snprintf(buf, max, "HTTP/1.0 %s %s\r\n"
+			"Content-Type: text/html\r\n"
+			"Content-Length: %zu\r\n"
+			"Content-Csum: %u\r\n\r\n%s",
+			errnum, shortmsg, len, csum, body);
+	return size < max ? size : 0;
 }
 
-/* reads and discards everything up to an empty text line */
+/* request_error(rq, filename, "404", "Not found", 
+ *		"OS server could not find this file");
+ */
 static void
-request_read_headers(struct rio *rp)
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
+{
+	char buf[3 * MAXBUF];
+	int size;
+
+	size = request_build_error(buf, sizeof(buf), cause, errnum, shortmsg,
+				   longmsg);
+	request_write(rq, buf, size);
+	rq->sent_status = atoi(errnum);
+}
+
+/* reads the request head into rq->buf, parsing as it goes. returns
+ * HTTP_DONE, or HTTP_ERROR if it is not valid, too long, or the client went
+ * away first. */
+static int
+request_read_head(struct request *rq)
 {
-	char buf[MAXLINE];
+	int ret = HTTP_MORE;
+	ssize_t n;
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	http_parser_init(&rq->http);
+	while (ret == HTTP_MORE) {
+		if (rq->len == sizeof(rq->buf))
+			return HTTP_ERROR;
+		n = read(rq->fd, rq->buf + rq->len, sizeof(rq->buf) - rq->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return HTTP_ERROR;
+		rq->len += n;
+		ret = http_parse(&rq->http, rq->buf, rq->len);
 	}
-	return;
+	return ret;
 }
 
 
-/* Calculates filename from uri. 
+/* Calculates filename from uri, which is len bytes long. 
  * for this simple server, filename = .uri
  *
  * Adding the "./" means that files will only be served from the directory in
  * which the webserver is running.
  *
+ * Empty and "." path components are dropped, so that "/a//b", "a/./b" and
+ * "a/b" all become "./a/b". The file name is the cache key, and this is also
+ * the form in which the change watcher reports paths.
+ *
  * Also, we don't serve files with a .. in the path (see request_readfile). */
-static void
-request_parse_URI(char *uri, char *filename, size_t max)
+void
+request_parse_URI(const char *uri, size_t len, char *filename, size_t max)
 {
-	snprintf(filename, max, "./%s", uri);
+	size_t n = 2, seg;
+	const char *p = uri, *end, *stop = uri + len;
+
+	assert(max > 2);
+	strcpy(filename, "./");
+	while (p < stop) {
+		end = memchr(p, '/', stop - p);
+		seg = end ? end - p : stop - p;
+		if (seg > 0 && !(seg == 1 && p[0] == '.')) {
+			if (n > 2 && n < max - 1)
+				filename[n++] = '/';
+			if (seg > max - 1 - n)
+				seg = max - 1 - n;
+			memcpy(filename + n, p, seg);
+			n += seg;
+		}
+		p = end ? end + 1 : stop;
+	}
+	filename[n] = '\0';
 }
 
-/* Fills in the filetype given the filename */
-static void
-request_get_file_type(char *filename, char *filetype)
+/* Returns the filetype given the filename */
+static const char *
+request_get_file_type(char *filename)
 {
 	if (strstr(filename, ".html"))
-		strcpy(filetype, "text/html");
+		return "text/html";
 	else if (strstr(filename, ".gif"))
-		strcpy(filetype, "image/gif");
+		return "image/gif";
 	else if (strstr(filename, ".jpg"))
-		strcpy(filetype, "image/jpeg");
+		return "image/jpeg";
 	else
-		strcpy(filetype, "text/plain");
+		return "text/plain";
 }
 
 /* entry point to this file */
@@ -103,100 +233,456 @@ request_get_file_type(char *filename, char *filetype)
 struct request *
 request_init(int connfd, struct file_data *data)
 {
-	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	struct rio *rio;
+	char method[64];
 	struct request *rq;
+	struct http_slice *uri;
 
 	assert(data);
-	rq = Malloc(sizeof(struct request));
+	pthread_once(&request_once, request_key_init);
+	if ((rq = pthread_getspecific(request_key)) != NULL)
+		pthread_setspecific(request_key, NULL);
+	else
+		rq = Malloc(sizeof(struct request));
 	rq->fd = connfd;
+	rq->start = request_access_log != NULL ? accesslog_now() : 0;
+	rq->sent_status = 0;
+	rq->sent_bytes = 0;
+	rq->cache = "-";
+	rq->file_fd = -1;
+	rq->encoding = 0;
+	rq->chunked = 0;
+	rq->aborted = 0;
+	rq->stat_known = 0;
 	rq->data = data;
-	data->file_name = Malloc(MAXLINE);
+	rq->status = 0;
+	rq->why = NULL;
+	rq->len = 0;
 	data->file_buf = NULL;
 	data->file_size = 0;
-	rio = Rio_init(rq->fd);
-	Rio_readlineb(rio, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", method, uri, version);
+	data->file_ready = 0;
 
-	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
-	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
+	if (request_read_head(rq) != HTTP_DONE) {
+		if (rq->len > 0)
+			request_error(rq, "", "400", "Bad Request",
+				      "OS Web Server could not parse this "
+				      "request");
+		request_destroy(rq);
+		return NULL;
+	}
+	if (!http_slice_eq(&rq->http.method, "GET")) {
+		snprintf(method, sizeof(method), "%.*s",
+			 (int)rq->http.method.len, rq->http.method.p);
+		request_error(rq, method, "501", "Not Implemented",
 			     "OS Web Server does not implement this method");
-		Rio_destroy(rio);
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
-	request_parse_URI(uri, data->file_name, MAXLINE);
-	Rio_destroy(rio);
+	/* "./", the path, and the NUL */
+	uri = &rq->http.uri;
+	request_allocname(data, uri->len + 3);
+	request_parse_URI(uri->p, uri->len, data->file_name, uri->len + 3);
 	return rq;
 }
 
+/* copies as much of s as fits into buf, which has room for max bytes */
+static void
+request_copy_slice(char *buf, size_t max, const struct http_slice *s)
+{
+	size_t n = s->len < max - 1 ? s->len : max - 1;
+
+	/* parts that weren't parsed are empty, with no bytes */
+	if (n > 0)
+		memcpy(buf, s->p, n);
+	buf[n] = '\0';
+}
+
+/* puts rq in the access log, as it was answered */
+static void
+request_log(struct request *rq)
+{
+	struct accesslog_entry *e;
+
+	if ((e = accesslog_next(request_access_log)) == NULL)
+		return;
+	e->end = accesslog_now();
+	e->latency = e->end - rq->start;
+	e->bytes = rq->sent_bytes;
+	e->cache = rq->cache;
+	e->status = rq->sent_status;
+	request_copy_slice(e->method, sizeof(e->method), &rq->http.method);
+	request_copy_slice(e->path, sizeof(e->path), &rq->http.uri);
+	accesslog_commit(request_access_log);
+}
+
+/* records how the cache served rq, for the access log. how must stay. */
+void
+request_set_cache(struct request *rq, const char *how)
+{
+	rq->cache = how;
+}
+
+/* returns the HTTP status of the response sent for rq, or 0 if none was */
+int
+request_sent_status(struct request *rq)
+{
+	return rq->sent_status;
+}
+
+/* gives up on the response to rq partway through the body, e.g. because the
+ * file changed while it was sent. nothing more is written, and the
+ * connection is reset instead of closed, so that the client sees an error
+ * rather than a body that ends early or has the wrong contents. */
+void
+request_abort(struct request *rq)
+{
+	struct linger lg;
+
+	if (rq->aborted)
+		return;
+	rq->aborted = 1;
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	SYS(setsockopt(rq->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)));
+}
+
 void
 request_destroy(struct request *rq)
 {
 	assert(rq);
 	/* close the connection fd */
 	SYS(close(rq->fd));
-	free(rq);
+	/* a connection that sent nothing is not a request */
+	if (request_access_log != NULL && rq->len > 0)
+		request_log(rq);
+	if (pthread_getspecific(request_key) == NULL)
+		pthread_setspecific(request_key, rq);
+	else
+		free(rq);
 }
 
-/* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
- * Returns 0 on failure, sends error to client. */
+/* makes file_name big enough for size bytes, with the NUL, keeping what is
+ * in it, and returns it. file data keep the buffer when they are reused
+ * (see file_data_init), so it is rounded up to make it likely to fit the
+ * next name as well. */
+char *
+request_allocname(struct file_data *data, size_t size)
+{
+	char *name;
+
+	if (size > data->file_name_max) {
+		size = (size + 63) & ~(size_t)63;
+		name = realloc(data->file_name, size);
+		if (name == NULL) {
+			fprintf(stderr, "%s: realloc: %s\n", __FUNCTION__,
+				strerror(errno));
+			exit(1);
+		}
+		data->file_name = name;
+		data->file_name_max = size;
+	}
+	return data->file_name;
+}
+
+/* allocates file_buf for file_size bytes, from wherever file_storage says.
+ * mappings are made by request_readfile instead. */
+void
+request_allocbuf(struct file_data *data)
+{
+	assert(data->file_storage != FILE_STORAGE_MMAP);
+	if (data->file_size == 0)
+		data->file_buf = NULL;
+	else if (data->file_storage == FILE_STORAGE_ARENA)
+		data->file_buf = arena_alloc(data->file_arena, data->file_size);
+	else
+		data->file_buf = Malloc(data->file_size);
+}
+
+/* releases file_buf the way it was obtained */
+void
+request_freebuf(struct file_data *data)
+{
+	switch (data->file_storage) {
+	case FILE_STORAGE_ARENA:
+		arena_free(data->file_arena, data->file_buf, data->file_zsize ?
+			   data->file_zsize : data->file_size);
+		break;
+	case FILE_STORAGE_MMAP:
+		if (data->file_buf)
+			SYS(munmap(data->file_buf, data->file_size));
+		break;
+	default:
+		free(data->file_buf);
+	}
+	data->file_buf = NULL;
+}
+
+/* maps the file instead of copying it, so the body lives in the kernel page
+ * cache and is shared with every other process serving the same file */
+static void
+request_mapfile(struct file_data *data, int srcfd)
+{
+	static int mlock_warned;
+	int flags = MAP_SHARED;
+
+	if (data->file_mlock)
+		flags |= MAP_POPULATE;
+	data->file_buf = mmap(NULL, data->file_size, PROT_READ, flags, srcfd, 0);
+	if (data->file_buf == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s: %s\n", __FUNCTION__,
+			data->file_name, strerror(errno));
+		exit(1);
+	}
+	if (data->file_mlock && mlock(data->file_buf, data->file_size) < 0 &&
+	    !mlock_warned) {
+		/* usually RLIMIT_MEMLOCK, the mapping still works unlocked */
+		mlock_warned = 1;
+		fprintf(stderr, "%s: mlock: %s\n", __FUNCTION__,
+			strerror(errno));
+	}
+}
+
+/* builds the name of the enc copy of the file called name into buf, which
+ * has room for max bytes. returns 0 if it doesn't fit. */
 int
-request_readfile(struct request *rq)
+request_sidecar_name(const char *name, int enc, char *buf, size_t max)
 {
-	int srcfd;
-	struct stat sbuf;
-	struct file_data *data;
-	char *ext;
+	int i;
 
-	data = rq->data;
-	assert(data);
+	for (i = 0; i < NR_ENCODINGS; i++) {
+		if (request_encodings[i].enc == enc)
+			return snprintf(buf, max, "%s%s", name,
+					request_encodings[i].ext) < max;
+	}
+	return 0;
+}
+
+/* returns the FILE_ENC_* copy that name is of, or 0 */
+static int
+request_sidecar_of(const char *name)
+{
+	size_t len = strlen(name), n;
+	int i;
+
+	for (i = 0; i < NR_ENCODINGS; i++) {
+		n = strlen(request_encodings[i].ext);
+		if (len > n &&
+		    strcmp(name + len - n, request_encodings[i].ext) == 0)
+			return request_encodings[i].enc;
+	}
+	return 0;
+}
+
+/* returns the length of the name of the file that name is a copy of, or 0
+ * if it isn't one */
+size_t
+request_sidecar_base(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_ENCODINGS; i++) {
+		if (request_encodings[i].enc == request_sidecar_of(name))
+			return strlen(name) - strlen(request_encodings[i].ext);
+	}
+	return 0;
+}
+
+/* finds the copies of data->file_name that are no older than it, once its
+ * file_mtime is known, and stats them into copies, in the order of
+ * request_encodings. copies of copies aren't looked for. */
+static int
+request_find_encodings(struct file_data *data, struct stat *copies)
+{
+	char path[MAXLINE];
+	int i, found = 0;
+
+	if (request_sidecar_of(data->file_name))
+		return 0;
+	for (i = 0; i < NR_ENCODINGS; i++) {
+		if (request_sidecar_name(data->file_name,
+					 request_encodings[i].enc, path,
+					 sizeof(path)) &&
+		    stat(path, &copies[i]) == 0 && S_ISREG(copies[i].st_mode) &&
+		    copies[i].st_mtime >= data->file_mtime)
+			found |= request_encodings[i].enc;
+	}
+	return found;
+}
+
+/* checks whether the file for rq has copies, for when nothing about it is
+ * cached. a file that can't be served has none. what was found is kept for
+ * request_findfile. */
+int
+request_stat_encodings(struct request *rq)
+{
+	struct file_data *data = rq->data;
+
+	rq->stat_known = 1;
+	rq->stat_encodings = 0;
+	rq->stat_status = request_checkfile(data, &rq->stat_file,
+					    &rq->stat_why);
+	if (rq->stat_status != 0)
+		return 0;
+	data->file_mtime = rq->stat_file.st_mtime;
+	rq->stat_encodings = request_find_encodings(data, rq->stat_copies);
+	return rq->stat_encodings;
+}
+
+/* returns the copy out of encodings that the client prefers, going by
+ * Accept-Encoding, or 0 if it takes none of them. q=0 rules a coding out,
+ * "*" stands for those not named, and ties go to the smaller br. */
+int
+request_pick_encoding(struct request *rq, int encodings)
+{
+	const struct http_slice *h = http_header(&rq->http, "Accept-Encoding");
+	double q[NR_ENCODINGS], star = -1, v;
+	const char *p, *end, *tok;
+	size_t len;
+	int i, best = 0;
+	double best_q = 0;
+
+	if (h == NULL || encodings == 0)
+		return 0;
+	for (i = 0; i < NR_ENCODINGS; i++)
+		q[i] = -1;
+	p = h->p;
+	end = h->p + h->len;
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		tok = p;
+		while (p < end && *p != ',' && *p != ';' && *p != ' ' &&
+		       *p != '\t')
+			p++;
+		len = p - tok;
+		v = 1;
+		/* parameters, of which only q counts */
+		while (p < end && *p != ',') {
+			if (*p == 'q' && p + 1 < end && p[1] == '=' &&
+			    (p[-1] == ';' || p[-1] == ' ' || p[-1] == '\t'))
+				v = strtod(p + 2, NULL);
+			p++;
+		}
+		if (len == 1 && tok[0] == '*') {
+			star = v;
+			continue;
+		}
+		for (i = 0; i < NR_ENCODINGS; i++) {
+			if ((len == strlen(request_encodings[i].name) &&
+			     strncasecmp(tok, request_encodings[i].name,
+					 len) == 0) ||
+			    (request_encodings[i].enc == FILE_ENC_GZ &&
+			     len == 6 && strncasecmp(tok, "x-gzip", 6) == 0))
+				q[i] = v;
+		}
+	}
+	for (i = 0; i < NR_ENCODINGS; i++) {
+		v = q[i] >= 0 ? q[i] : star;
+		if ((encodings & request_encodings[i].enc) && v > best_q) {
+			best = request_encodings[i].enc;
+			best_q = v;
+		}
+	}
+	return best;
+}
+
+/* sends the enc copy of the requested file instead of the file, or the
+ * file again if enc is 0 */
+void
+request_set_encoding(struct request *rq, int enc)
+{
+	struct file_data *data = rq->data;
+	int i;
+
+	if (rq->encoding != 0)
+		data->file_name[request_sidecar_base(data->file_name)] = '\0';
+	rq->encoding = enc;
+	if (enc == 0)
+		return;
+	for (i = 0; request_encodings[i].enc != enc; i++)
+		;
+	request_allocname(data, strlen(data->file_name) +
+			  strlen(request_encodings[i].ext) + 1);
+	strcat(data->file_name, request_encodings[i].ext);
+}
+
+/* returns the FILE_ENC_* copy sent instead of the file, or 0 */
+int
+request_get_encoding(struct request *rq)
+{
+	return rq->encoding;
+}
+
+/* checks that data->file_name may be served, and stats it into sbuf.
+ * Returns 0 if it may, or the HTTP status of the error with why set to a
+ * message for the client. */
+static int
+request_checkfile(struct file_data *data, struct stat *sbuf, const char **why)
+{
+	char *ext;
 
 	/* don't serve files that start with /, or .., or end in .c */
 	if (data->file_name[0] == '/') {
 		/* this shouldn't really happen because we add a "./" at the
 		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with absolute paths");
-		return 0;
+		*why = "OS Web Server doesn't serve files with absolute paths";
+		return 404;
 	}
 	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with .. in the path");
-		return 0;
+		*why = "OS Web Server doesn't serve files with .. in the path";
+		return 404;
 	}
 	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
 	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve C or header files ");
-		return 0;
+		*why = "OS Web Server doesn't serve C or header files ";
+		return 404;
 	}
 
-	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server could not find this file");
-		return 0;
+	if (stat(data->file_name, sbuf) < 0) {
+		*why = "OS Web Server could not find this file";
+		return 404;
 	}
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
-			      "OS Web Server could not read this file");
-		return 0;
+	if (!(S_ISREG(sbuf->st_mode)) || !(S_IRUSR & sbuf->st_mode)) {
+		*why = "OS Web Server could not read this file";
+		return 403;
 	}
+	return 0;
+}
+
+/* fills in data from sbuf, what request_checkfile found for its file, and
+ * the copies of it, which are looked for unless encodings has them. these
+ * are the fields that don't need the contents of the file. */
+static void
+request_statfile(struct file_data *data, const struct stat *sbuf,
+		 int encodings)
+{
+	struct stat copies[NR_ENCODINGS];
+
+	data->file_size = sbuf->st_size;
+	data->file_mtime = sbuf->st_mtime;
+	data->file_mtime_ns = sbuf->st_mtim.tv_nsec;
+	data->file_ino = sbuf->st_ino;
+	data->file_encodings = encodings >= 0 ? encodings :
+		request_find_encodings(data, copies);
+	data->file_type = request_get_file_type(data->file_name);
+}
 
-	data->file_size = sbuf.st_size;
+/* reads the file of data, of the size request_statfile filled in */
+static void
+request_readbody(struct file_data *data)
+{
+	int srcfd;
 
 	if (data->file_size) {
 		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
+		if (data->file_storage == FILE_STORAGE_MMAP) {
+			request_mapfile(data, srcfd);
+		} else {
+			request_allocbuf(data);
+			Rio_read(srcfd, data->file_buf, data->file_size);
+			/* ask the kernel to stop caching the file */
+			SYS(posix_fadvise(srcfd, 0, data->file_size, 
+					  POSIX_FADV_DONTNEED));
+		}
 		SYS(close(srcfd));
 		/* we do this to simulate a slow disk. otherwise, file caching
 		 * doesn't have much benefit because a lot of the time is spent
@@ -204,9 +690,339 @@ request_readfile(struct request *rq)
 		 * request_readfile does not have much impact. */
 		usleep(10000);
 	}
+	request_preparefile(data);
+}
+
+/* reads data->file_name into data->file_buf and data->file_size, and
+ * prepares the derived fields. this is the part of request_readfile that
+ * does not need a client, so it is also used to warm up the cache.
+ * Returns 0 on success, or the HTTP status of the error with why set to a
+ * message for the client. */
+int
+request_loadfile(struct file_data *data, const char **why)
+{
+	struct stat sbuf;
+	int status;
+
+	if ((status = request_checkfile(data, &sbuf, why)) != 0)
+		return status;
+	request_statfile(data, &sbuf, -1);
+	request_readbody(data);
+	return 0;
+}
+
+/* records the result of loading the file for rq, and sends the error to the
+ * client if there was one. returns 1 if there wasn't. */
+static int
+request_set_status(struct request *rq, int status, const char *why)
+{
+	rq->status = status;
+	rq->why = why;
+	if (status == 403) {
+		request_error(rq, rq->data->file_name, "403", "Forbidden",
+			      (char *)why);
+		return 0;
+	} else if (status != 0) {
+		request_error(rq, rq->data->file_name, "404", "Not found",
+			      (char *)why);
+		return 0;
+	}
+	return 1;
+}
+
+/* request_checkfile for the file for rq, from what request_stat_encodings
+ * found if it was called */
+static int
+request_checkfile_known(struct request *rq, struct stat *sbuf,
+			const char **why)
+{
+	int i;
+
+	if (!rq->stat_known)
+		return request_checkfile(rq->data, sbuf, why);
+	if (rq->encoding == 0) {
+		*sbuf = rq->stat_file;
+		*why = rq->stat_why;
+		return rq->stat_status;
+	}
+	/* a copy is only sent if it was found, so it is a regular file */
+	for (i = 0; request_encodings[i].enc != rq->encoding; i++)
+		;
+	*sbuf = rq->stat_copies[i];
+	if (!(S_IRUSR & sbuf->st_mode)) {
+		*why = "OS Web Server could not read this file";
+		return 403;
+	}
+	return 0;
+}
+
+/* the copies of the file for rq, if request_stat_encodings found them, or
+ * -1 if they are to be looked for */
+static int
+request_known_encodings(struct request *rq)
+{
+	if (!rq->stat_known)
+		return -1;
+	/* copies have none of their own */
+	return rq->encoding == 0 ? rq->stat_encodings : 0;
+}
+
+/* checks the file for rq, and stats it into sbuf. Returns 1 if it may be
+ * served, and 0 if not, after sending the error to the client. */
+static int
+request_findfile(struct request *rq, struct stat *sbuf)
+{
+	const char *why = NULL;
+	int status;
+
+	status = request_checkfile_known(rq, sbuf, &why);
+	if (status != 0 && rq->encoding != 0) {
+		/* the copy is gone, send the file itself */
+		request_set_encoding(rq, 0);
+		status = request_checkfile_known(rq, sbuf, &why);
+	}
+	return request_set_status(rq, status, why);
+}
+
+/* read in filename corresponding to request. 
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * If stream is given and says that the file, stat'ed into rq->data but not
+ * read yet, should be streamed, it is sent with request_streamfile instead,
+ * chunk is handed each piece of it, and REQUEST_STREAMED is returned.
+ * Either way the file is only stat'ed once. stream and chunk are passed arg.
+ * Returns 0 on failure, sends error to client. */
+int
+request_readfile(struct request *rq, request_stream_fn stream,
+		 request_chunk_fn chunk, void *arg)
+{
+	struct file_data *data;
+	struct stat sbuf;
+
+	data = rq->data;
+	assert(data);
+
+	if (!request_findfile(rq, &sbuf))
+		return 0;
+	request_statfile(data, &sbuf, request_known_encodings(rq));
+	if (stream != NULL && stream(arg, data)) {
+		request_streamfile(rq, chunk, arg);
+		return REQUEST_STREAMED;
+	}
+	request_readbody(data);
+	return 1;
+}
+
+/* sends len bytes of the open file from off with sendfile(2), so that
+ * they don't pass through the server's memory */
+static void
+request_body_disk(struct request *rq, void *arg, long off, long len)
+{
+	off_t pos = off;
+	ssize_t n;
+
+	while (len > 0) {
+		n = sendfile(rq->fd, rq->file_fd, &pos, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		SYS(n);
+		if (n == 0)
+			break;	/* the file got shorter */
+		rq->sent_bytes += n;
+		len -= n;
+	}
+}
+
+/* opens the file for rq into rq->file_fd, to be sent from the disk. its
+ * size and the rest are already filled in by request_statfile. */
+static void
+request_openfile(struct request *rq)
+{
+	struct file_data *data = rq->data;
+
+	SYS(rq->file_fd = open(data->file_name, O_RDONLY, 0));
+	/* the same slow disk as in request_loadfile */
+	if (data->file_size)
+		usleep(10000);
+}
+
+static void
+request_closefile(struct request *rq)
+{
+	SYS(close(rq->file_fd));
+	rq->file_fd = -1;
+}
+
+/* sends the file, or the ranges of it that were asked for, straight from
+ * the disk without reading it into memory. the file is not checksummed or
+ * processed, so there is no Content-Csum. Returns 1 on success, and 0 on
+ * failure, after sending the error to the client. */
+int
+request_sendfile_disk(struct request *rq)
+{
+	struct stat sbuf;
+
+	if (!request_findfile(rq, &sbuf))
+		return 0;
+	request_statfile(rq->data, &sbuf, request_known_encodings(rq));
+	request_openfile(rq);
+	if (request_send_header(rq))
+		request_send_ranges(rq, request_body_disk, NULL);
+	request_closefile(rq);
 	return 1;
 }
 
+/* reads up to len bytes of the open file from off into rq->chunk, and
+ * returns how many there were. the kernel is asked to read the chunk after
+ * it meanwhile, so that it comes in from the disk while this one is sent:
+ * the page cache is the second buffer. */
+static long
+request_read_chunk(struct request *rq, long off, long len)
+{
+	long got = 0;
+	ssize_t n;
+
+	if (off + len < rq->data->file_size)
+		SYS(posix_fadvise(rq->file_fd, off + len, REQUEST_CHUNK,
+				  POSIX_FADV_WILLNEED));
+	while (got < len) {
+		n = pread(rq->file_fd, rq->chunk + got, len - got, off + got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		SYS(n);
+		if (n == 0)
+			break;	/* the file got shorter */
+		got += n;
+	}
+	return got;
+}
+
+/* what request_body_stream has sent of a streamed file */
+struct request_stream {
+	unsigned int csum;	/* checksum of the bytes sent */
+	long sent;		/* how many there were */
+	request_chunk_fn chunk;	/* is handed them too, unless NULL */
+	void *arg;
+};
+
+/* sends len bytes of the open file from off a chunk at a time, adding
+ * them to the checksum at arg and processing them as they go by */
+static void
+request_body_stream(struct request *rq, void *arg, long off, long len)
+{
+	struct request_stream *st = arg;
+	char buf[32];
+	long n;
+	int size;
+
+	while (len > 0) {
+		n = request_read_chunk(rq, off, len < REQUEST_CHUNK ? len :
+				       REQUEST_CHUNK);
+		if (n == 0)
+			break;
+		st->csum = request_csum(rq->chunk, n, st->csum);
+		st->sent += n;
+		rq->data->file_processed += request_processfile(rq->chunk, n);
+		if (rq->chunked) {
+			size = sprintf(buf, "%lx\r\n", n);
+			request_write(rq, buf, size);
+		}
+		request_write(rq, rq->chunk, n);
+		if (rq->chunked)
+			request_write(rq, "\r\n", 2);
+		if (st->chunk != NULL)
+			st->chunk(st->arg, rq->chunk, off, n);
+		/* as in request_loadfile, don't let the kernel keep it */
+		SYS(posix_fadvise(rq->file_fd, off, n, POSIX_FADV_DONTNEED));
+		off += n;
+		len -= n;
+	}
+}
+
+/* returns 1 if the client can take the checksum in a trailer, after a
+ * chunked body: it asked with HTTP/1.1 and "TE: trailers" */
+static int
+request_takes_trailers(struct request *rq)
+{
+	const struct http_slice *h = http_header(&rq->http, "TE");
+	const char *p, *end, *tok;
+
+	if (h == NULL || !http_slice_eq(&rq->http.version, "HTTP/1.1"))
+		return 0;
+	p = h->p;
+	end = h->p + h->len;
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		tok = p;
+		while (p < end && *p != ',' && *p != ';' && *p != ' ' &&
+		       *p != '\t')
+			p++;
+		if (p - tok == 8 && strncasecmp(tok, "trailers", 8) == 0)
+			return 1;
+		while (p < end && *p != ',')
+			p++;
+	}
+	return 0;
+}
+
+/* sends the file without reading it into memory whole, for files too large
+ * to be worth it. it is read, checksummed, processed and sent a chunk at a
+ * time, so the first bytes go out before the rest is read and the memory
+ * used doesn't grow with the file. the checksum is only known at the end:
+ * clients that take trailers get it in one, after a chunked body, and the
+ * others get no Content-Csum, as for a range sent from the disk. once the
+ * whole file went by, data has the checksum as if the file had been read.
+ * chunk, if given, is handed each chunk after it is sent. */
+static void
+request_streamfile(struct request *rq, request_chunk_fn chunk, void *arg)
+{
+	struct file_data *data = rq->data;
+	struct request_stream st = { 0, 0, chunk, arg };
+	char buf[64];
+	int size;
+
+	request_openfile(rq);
+	data->file_processed = 0;
+	rq->chunked = request_takes_trailers(rq);
+	if (request_send_header(rq)) {
+		request_send_ranges(rq, request_body_stream, &st);
+		if (rq->chunked) {
+			size = snprintf(buf, sizeof(buf), "0\r\n"
+					"Content-Csum: %u\r\n\r\n", st.csum);
+			request_write(rq, buf, size);
+		}
+		if (rq->nr_ranges == 0 && st.sent == data->file_size) {
+			data->file_csum = st.csum;
+			data->file_ready = 1;
+		}
+	}
+	request_closefile(rq);
+	rq->chunked = 0;
+}
+
+/* if request_readfile failed, builds the error response it sent into buf,
+ * which has room for max bytes, and returns its length. returns 0
+ * otherwise, or if it does not fit. */
+int
+request_get_error(struct request *rq, char *buf, size_t max)
+{
+	if (rq->status == 0)
+		return 0;
+	if (rq->status == 403)
+		return request_build_error(buf, max, rq->data->file_name,
+					   "403", "Forbidden", (char *)rq->why);
+	return request_build_error(buf, max, rq->data->file_name, "404",
+				   "Not found", (char *)rq->why);
+}
+
+/* sends a response that was built beforehand */
+void
+request_send_response(struct request *rq, const char *buf, int size)
+{
+	request_write(rq, (void *)buf, size);
+	sscanf(buf, "HTTP/%*s %d", &rq->sent_status);
+}
+
 /* if you have previous file data, you can reuse it */
 void
 request_set_data(struct request *rq, struct file_data *data)
@@ -219,52 +1035,422 @@ request_set_data(struct request *rq, struct file_data *data)
  * various server parameters have no affect on server performance. this is a
  * problem because we have 100 Mb/s network. With faster networks, we wouldn't
  * have to do this artificial work. */
-static void
-request_processfile(struct request *rq)
+static int
+request_processfile(const char *buf, long size)
 {
-	struct file_data *data;
-	int i, j, dummy;
-	data = rq->data;
-	assert(data);
+	long i, j;
+	int dummy = 0;
 
 	for (i = 0; i < 128; i++) {
-		for (j = 0; j < data->file_size; j++) {
-			dummy += (unsigned char)(data->file_buf[j]);
+		for (j = 0; j < size; j++) {
+			dummy += (unsigned char)(buf[j]);
 		}
 	}
+	return dummy;
 }
 
-/* send filename to the fd connection */
-void
-request_sendfile(struct request *rq)
+/* adds size bytes of buf to a very trivial checksum */
+static unsigned int
+request_csum(const char *buf, long size, unsigned int csum)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
-	int i;
-	unsigned int csum = 0;
+	long i;
+
+	for (i = 0; i < size; i++) {
+		csum += (unsigned char)(buf[i]);
+	}
+	return csum;
+}
+
+/* computes everything that depends only on the file contents, so that it is
+ * done once when the file is read rather than on every request for it */
+static void
+request_preparefile(struct file_data *data)
+{
+	data->file_type = request_get_file_type(data->file_name);
+	data->file_csum = request_csum(data->file_buf, data->file_size, 0);
+	/* do some processing */
+	data->file_processed = request_processfile(data->file_buf,
+						   data->file_size);
+	data->file_ready = 1;
+}
+
+/* builds the entity tag of data into buf, quoted, from its inode, its size
+ * and the time it was last changed, to the nanosecond so that a file
+ * rewritten within a second gets a new tag. all come from stat, so that a
+ * file sent straight from the disk has the same tag as when it is cached. */
+static void
+request_etag(const struct file_data *data, char *buf, size_t max)
+{
+	snprintf(buf, max, "\"%lx-%lx-%lx.%lx\"",
+		 (unsigned long)data->file_ino, data->file_size,
+		 (long)data->file_mtime, data->file_mtime_ns);
+}
+
+/* returns 1 if the If-None-Match list has etag in it, or is "*". tags are
+ * compared weakly, ignoring W/, as RFC 9110 says for If-None-Match. */
+static int
+request_etag_match(const struct http_slice *list, const char *etag)
+{
+	const char *p = list->p, *end = list->p + list->len, *q;
+	size_t len = strlen(etag);
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		if (p == end)
+			break;
+		if (*p == '*')
+			return 1;
+		if (end - p > 2 && p[0] == 'W' && p[1] == '/')
+			p += 2;
+		/* the tag is quoted, and may have commas in it */
+		if (*p == '"' && (q = memchr(p + 1, '"', end - p - 1)) != NULL) {
+			if (q + 1 - p == len && memcmp(p, etag, len) == 0)
+				return 1;
+			p = q + 1;
+		}
+		while (p < end && *p != ',')
+			p++;
+	}
+	return 0;
+}
+
+/* parses an HTTP date in any of the three formats of RFC 9110, e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT", "Sunday, 06-Nov-94 08:49:37 GMT" and
+ * "Sun Nov  6 08:49:37 1994". returns 0 if it isn't one. */
+static int
+request_parse_date(const struct http_slice *s, time_t *t)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char buf[64], mon[4];
+	const char *m;
+	struct tm tm;
+
+	if (s->len >= sizeof(buf))
+		return 0;
+	memcpy(buf, s->p, s->len);
+	buf[s->len] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(buf, "%*[A-Za-z], %d %3s %d %d:%d:%d GMT", &tm.tm_mday,
+		   mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min,
+		   &tm.tm_sec) != 6 &&
+	    sscanf(buf, "%*[A-Za-z], %d-%3s-%d %d:%d:%d GMT", &tm.tm_mday,
+		   mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min,
+		   &tm.tm_sec) != 6 &&
+	    sscanf(buf, "%*3s %3s %d %d:%d:%d %d", mon, &tm.tm_mday,
+		   &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tm.tm_year) != 6)
+		return 0;
+	if (strlen(mon) != 3 || (m = strstr(months, mon)) == NULL ||
+	    (m - months) % 3 != 0)
+		return 0;
+	tm.tm_mon = (m - months) / 3;
+	/* two digit years are from the RFC 850 format */
+	if (tm.tm_year < 100)
+		tm.tm_year += tm.tm_year < 70 ? 2000 : 1900;
+	tm.tm_year -= 1900;
+	*t = timegm(&tm);
+	return *t != (time_t)-1;
+}
+
+/* returns 1 if the client already has rq->data, going by If-None-Match, or
+ * by If-Modified-Since when there is no If-None-Match. this only needs the
+ * size and the modification time, not the body, so a cached file that is
+ * compressed needn't be decompressed to answer it. */
+int
+request_not_modified(struct request *rq)
+{
+	const struct http_slice *inm, *ims;
+	struct file_data *data = rq->data;
+	char etag[REQUEST_ETAG];
+	time_t since;
+
+	if ((inm = http_header(&rq->http, "If-None-Match")) != NULL) {
+		request_etag(data, etag, sizeof(etag));
+		return request_etag_match(inm, etag);
+	}
+	if ((ims = http_header(&rq->http, "If-Modified-Since")) != NULL &&
+	    request_parse_date(ims, &since))
+		return data->file_mtime <= since;
+	return 0;
+}
+
+/* returns 1 if rq has a Range header, whether or not it can be used */
+int
+request_has_range(struct request *rq)
+{
+	return http_header(&rq->http, "Range") != NULL;
+}
+
+/* returns 1 if the Range header is to be used: there is no If-Range, or it
+ * names the file as it is now. a weak tag never does. */
+static int
+request_if_range(struct request *rq)
+{
+	const struct http_slice *h = http_header(&rq->http, "If-Range");
+	char etag[REQUEST_ETAG];
+	time_t t;
+
+	if (h == NULL)
+		return 1;
+	if (h->len > 0 && h->p[0] == '"') {
+		request_etag(rq->data, etag, sizeof(etag));
+		return h->len == strlen(etag) &&
+			memcmp(h->p, etag, h->len) == 0;
+	}
+	return request_parse_date(h, &t) && t == rq->data->file_mtime;
+}
+
+/* parses the digits at *p, up to end, into v. returns 0 if there are none.
+ * numbers too big for a long become LONG_MAX. */
+static int
+request_parse_pos(const char **p, const char *end, long *v)
+{
+	const char *start = *p;
+
+	*v = 0;
+	for (; *p < end && isdigit((unsigned char)**p); (*p)++) {
+		if (*v > (LONG_MAX - (**p - '0')) / 10)
+			*v = LONG_MAX;
+		else
+			*v = *v * 10 + (**p - '0');
+	}
+	return *p > start;
+}
+
+/* sets the ranges of the body to send from the Range header, e.g.
+ * "bytes=0-499", "bytes=500-", "bytes=-500" or "bytes=0-0,-1". returns 1
+ * if some of them are in the file, -1 if none are, and 0 if the whole file
+ * is to be sent: there is no Range header, it doesn't parse, or it has too
+ * many ranges. */
+static int
+request_parse_ranges(struct request *rq)
+{
+	const struct http_slice *h = http_header(&rq->http, "Range");
+	long size = rq->data->file_size, first, last;
+	const char *p, *end;
+	int specs = 0;
+
+	rq->nr_ranges = 0;
+	if (h == NULL || h->len < 6 || strncasecmp(h->p, "bytes=", 6) != 0 ||
+	    !request_if_range(rq))
+		return 0;
+	p = h->p + 6;
+	end = h->p + h->len;
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		if (p == end)
+			break;
+		if (*p == '-') {
+			/* the last bytes of the file */
+			p++;
+			if (!request_parse_pos(&p, end, &last))
+				return 0;
+			first = last < size ? size - last : 0;
+			last = last > 0 ? size - 1 : -1;
+		} else {
+			if (!request_parse_pos(&p, end, &first) ||
+			    p == end || *p++ != '-')
+				return 0;
+			if (!request_parse_pos(&p, end, &last))
+				last = size - 1;
+			else if (last < first)
+				return 0;
+		}
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p < end && *p != ',')
+			return 0;
+		specs++;
+		if (first >= size || last < 0)
+			continue;	/* not in the file */
+		if (rq->nr_ranges == REQUEST_MAX_RANGES)
+			return 0;
+		if (last >= size)
+			last = size - 1;
+		rq->range_start[rq->nr_ranges] = first;
+		rq->range_len[rq->nr_ranges] = last - first + 1;
+		rq->nr_ranges++;
+	}
+	if (specs == 0)
+		return 0;
+	return rq->nr_ranges > 0 ? 1 : -1;
+}
+
+/* builds the header of part i of a multipart/byteranges body into buf,
+ * which has room for max bytes, and returns its length */
+static int
+request_part_header(struct request *rq, int i, char *buf, size_t max)
+{
+	return snprintf(buf, max, "\r\n--%s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+			rq->boundary, rq->data->file_type, rq->range_start[i],
+			rq->range_start[i] + rq->range_len[i] - 1,
+			rq->data->file_size);
+}
+
+/* sends the response header for rq->data. if the client already has the
+ * file, that is a 304, and if it asked only for ranges that are not in the
+ * file, a 416. both have no body, and this returns 0. otherwise it returns
+ * 1 and the body should follow, sent with request_send_ranges. */
+int
+request_send_header(struct request *rq)
+{
+	static unsigned long boundaries;
+	char buf[MAXBUF], part[MAXBUF], etag[REQUEST_ETAG], date[64];
 	struct file_data *data;
-	long size = 0;
+	struct tm tm;
+	long size = 0, length;
+	int status, i;
 
 	data = rq->data;
 	assert(data);
 
-	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	/* a file cached in blocks has no body here, its checksum is only
+	 * known once it was streamed whole */
+	if (!data->file_ready && rq->file_fd < 0 && data->file_blocks == 0) {
+		request_preparefile(data);
 	}
-	/* do some processing */
-	request_processfile(rq);
+	rq->nr_ranges = 0;
+	if (request_not_modified(rq))
+		status = 304;
+	else if ((i = request_parse_ranges(rq)) != 0)
+		status = i > 0 ? 206 : 416;
+	else
+		status = 200;
+	/* only a whole body is sent in chunks */
+	if (status != 200)
+		rq->chunked = 0;
+	request_etag(data, etag, sizeof(etag));
+	gmtime_r(&data->file_mtime, &tm);
+	strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
 	/* put together response */
-	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	if (status == 200 && rq->chunked)
+		size += sprintf(buf + size, "HTTP/1.1 200 OK\r\n");
+	else if (status == 200)
+		size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
+	else if (status == 206)
+		size += sprintf(buf + size, "HTTP/1.0 206 Partial Content\r\n");
+	else if (status == 304)
+		size += sprintf(buf + size, "HTTP/1.0 304 Not Modified\r\n");
+	else
+		size += sprintf(buf + size, "HTTP/1.0 416 Range Not "
+				"Satisfiable\r\n");
 	size += sprintf(buf + size, "Server: OS Web Server\r\n");
-	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
-	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
+	size += sprintf(buf + size, "ETag: %s\r\n", etag);
+	size += sprintf(buf + size, "Last-Modified: %s\r\n", date);
+	size += sprintf(buf + size, "Accept-Ranges: bytes\r\n");
+	if (rq->encoding != 0) {
+		for (i = 0; request_encodings[i].enc != rq->encoding; i++)
+			;
+		size += sprintf(buf + size, "Content-Encoding: %s\r\n",
+				request_encodings[i].name);
+	}
+	/* caches must not hand a copy to clients that don't take it */
+	if (rq->encoding != 0 || data->file_encodings != 0)
+		size += sprintf(buf + size, "Vary: Accept-Encoding\r\n");
+	if (status == 200 && rq->chunked) {
+		/* the checksum follows the body */
+		size += sprintf(buf + size, "Content-Type: %s\r\n",
+				data->file_type);
+		size += sprintf(buf + size, "Connection: close\r\n");
+		size += sprintf(buf + size, "Transfer-Encoding: chunked\r\n");
+		size += sprintf(buf + size, "Trailer: Content-Csum\r\n");
+	} else if (status == 200) {
+		size += sprintf(buf + size, "Content-Type: %s\r\n",
+				data->file_type);
+		size += sprintf(buf + size, "Content-Length: %ld\r\n",
+				data->file_size);
+		if (data->file_ready)
+			size += sprintf(buf + size, "Content-Csum: %u\r\n",
+					data->file_csum);
+	} else if (status == 206 && rq->nr_ranges == 1) {
+		size += sprintf(buf + size, "Content-Type: %s\r\n",
+				data->file_type);
+		size += sprintf(buf + size, "Content-Range: bytes "
+				"%ld-%ld/%ld\r\n", rq->range_start[0],
+				rq->range_start[0] + rq->range_len[0] - 1,
+				data->file_size);
+		size += sprintf(buf + size, "Content-Length: %ld\r\n",
+				rq->range_len[0]);
+	} else if (status == 206) {
+		/* the boundary mustn't be in the body, make it unlikely */
+		snprintf(rq->boundary, sizeof(rq->boundary), "%016lx%016lx",
+			 (unsigned long)time(NULL) * 0x9e3779b97f4a7c15UL,
+			 __atomic_add_fetch(&boundaries, 1, __ATOMIC_RELAXED));
+		length = 0;
+		for (i = 0; i < rq->nr_ranges; i++)
+			length += request_part_header(rq, i, part,
+						      sizeof(part)) +
+				rq->range_len[i];
+		length += strlen("\r\n----\r\n") + strlen(rq->boundary);
+		size += sprintf(buf + size, "Content-Type: multipart/byteranges; "
+				"boundary=%s\r\n", rq->boundary);
+		size += sprintf(buf + size, "Content-Length: %ld\r\n", length);
+	} else if (status == 416) {
+		size += sprintf(buf + size, "Content-Range: bytes */%ld\r\n",
+				data->file_size);
+		size += sprintf(buf + size, "Content-Length: 0\r\n");
+	}
+	size += sprintf(buf + size, "\r\n");
 
-	Rio_write(rq->fd, buf, strlen(buf));
+	request_write(rq, buf, size);
+	rq->sent_status = status;
+	return status == 200 || status == 206;
+}
+
+/* sends the parts of the body that request_send_header said it would, with
+ * fn sending each range of the file */
+void
+request_send_ranges(struct request *rq, request_body_fn fn, void *arg)
+{
+	char buf[MAXBUF];
+	int i, n;
+
+	if (rq->nr_ranges == 0) {
+		fn(rq, arg, 0, rq->data->file_size);
+		return;
+	}
+	if (rq->nr_ranges == 1) {
+		fn(rq, arg, rq->range_start[0], rq->range_len[0]);
+		return;
+	}
+	for (i = 0; i < rq->nr_ranges; i++) {
+		n = request_part_header(rq, i, buf, sizeof(buf));
+		request_write(rq, buf, n);
+		fn(rq, arg, rq->range_start[i], rq->range_len[i]);
+	}
+	n = snprintf(buf, sizeof(buf), "\r\n--%s--\r\n", rq->boundary);
+	request_write(rq, buf, n);
+}
 
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+/* sends part of the body, after request_send_header */
+void
+request_send_body(struct request *rq, const char *buf, long size)
+{
+	if (size > 0) {
+		request_write(rq, (void *)buf, size);
 	}
 }
+
+/* writes len bytes of data->file_buf from off to the client socket */
+static void
+request_body_buf(struct request *rq, void *arg, long off, long len)
+{
+	request_send_body(rq, rq->data->file_buf + off, len);
+}
+
+/* send filename to the fd connection. returns 0 if there was no body to
+ * send, see request_send_header. */
+int
+request_sendfile(struct request *rq)
+{
+	assert(rq->data);
+
+	if (!request_send_header(rq))
+		return 0;
+	request_send_ranges(rq, request_body_buf, NULL);
+	return 1;
+}
@@ -1,16 +1,96 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+struct arena;
+struct accesslog;
+struct request;
+
+/* where file_buf comes from, which decides how it is released */
+enum file_storage {
+	FILE_STORAGE_HEAP,	/* Malloc() */
+	FILE_STORAGE_ARENA,	/* arena_alloc() from file_arena */
+	FILE_STORAGE_MMAP,	/* read-only shared mapping of the file */
+};
+
+/* precompressed copies of a file, kept next to it */
+#define FILE_ENC_BR	1	/* file.br, compressed with brotli */
+#define FILE_ENC_GZ	2	/* file.gz, compressed with gzip */
+#define FILE_ENC_ALL	(FILE_ENC_BR | FILE_ENC_GZ)
+
 struct file_data {
 	char *file_name; /* name of file being requested */
+	size_t file_name_max; /* bytes file_name has room for */
 	char *file_buf;	 /* file is read into this buffer in memory */
-	int file_size;	 /* file size */
+	enum file_storage file_storage;
+	struct arena *file_arena; /* for FILE_STORAGE_ARENA */
+	int file_mlock;	 /* for FILE_STORAGE_MMAP, lock the pages in memory */
+	long file_zsize; /* if > 0, file_buf holds the file compressed by lz.c
+			  * to this many bytes */
+	long file_size;	 /* file size */
+	time_t file_mtime; /* when the file was last modified */
+	long file_mtime_ns; /* and the nanoseconds past file_mtime */
+	ino_t file_ino;	 /* for the entity tag, a file replaced by another
+			  * one gets a new tag */
+	int file_encodings; /* FILE_ENC_* copies that are up to date */
+	int file_blocks; /* if > 0, file_buf is NULL and the body is cached
+			  * separately, in this many blocks */
+	/* derived from file_buf once, when it is filled, and reused on every
+	 * cache hit since the cached contents never change */
+	unsigned int file_csum;	/* checksum sent in Content-Csum */
+	const char *file_type;	/* Content-Type */
+	int file_processed;	/* result of request_processfile */
+	int file_ready;		/* the fields above are valid */
+	int file_refs;		/* references held, see file_data_put */
 };
 
+/* sends len bytes of the body of the file, starting at off */
+typedef void (*request_body_fn)(struct request *rq, void *arg, long off,
+				long len);
+
+/* returns 1 if the file of data, which is stat'ed but not read, is to be
+ * streamed, see request_readfile */
+typedef int (*request_stream_fn)(void *arg, struct file_data *data);
+
+/* is handed the len bytes of a streamed file from off as they are read */
+typedef void (*request_chunk_fn)(void *arg, const char *buf, long off,
+				 long len);
+
+/* request_readfile streamed the file rather than read it */
+#define REQUEST_STREAMED 2
+
 struct request *request_init(int connfd, struct file_data *data);
-int request_readfile(struct request *rq);
+int request_readfile(struct request *rq, request_stream_fn stream,
+		     request_chunk_fn chunk, void *arg);
+int request_sendfile_disk(struct request *rq);
+int request_has_range(struct request *rq);
+int request_pick_encoding(struct request *rq, int encodings);
+void request_set_encoding(struct request *rq, int enc);
+int request_get_encoding(struct request *rq);
+int request_stat_encodings(struct request *rq);
+int request_sidecar_name(const char *name, int enc, char *buf, size_t max);
+size_t request_sidecar_base(const char *name);
+int request_loadfile(struct file_data *data, const char **why);
+void request_parse_URI(const char *uri, size_t len, char *filename,
+		       size_t max);
+int request_get_error(struct request *rq, char *buf, size_t max);
+void request_send_response(struct request *rq, const char *buf, int size);
 void request_set_data(struct request *rq, struct file_data *data);
-void request_sendfile(struct request *rq);
+void request_allocbuf(struct file_data *data);
+char *request_allocname(struct file_data *data, size_t size);
+void request_freebuf(struct file_data *data);
+int request_not_modified(struct request *rq);
+int request_send_header(struct request *rq);
+void request_send_body(struct request *rq, const char *buf, long size);
+void request_send_ranges(struct request *rq, request_body_fn fn, void *arg);
+void request_abort(struct request *rq);
+int request_sendfile(struct request *rq);
+void request_set_cache(struct request *rq, const char *how);
+int request_sent_status(struct request *rq);
+void request_set_log(struct accesslog *log);
 void request_destroy(struct request *rq);
 
 #endif
@@ -1,4 +1,6 @@
 #include <malloc.h>
+#include <popt.h>
+#include <limits.h>
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
@@ -7,20 +9,86 @@
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [options] portnum nr_threads max_requests max_cache_size
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
  */
 
+poptContext context;	/* context for parsing command-line options */
+
 static void
-usage(char *program)
+usage(const char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
+	fprintf(stderr, "Usage: %s [options] port nr_threads max_requests "
 		"max_cache_size\n", program);
+	poptPrintUsage(context, stderr, 0);
 	exit(1);
 }
 
+static char *policy = "gdsf";
+
+static const char *policy_names[] = {
+	[CACHE_POLICY_LRU] = "lru",
+	[CACHE_POLICY_GDSF] = "gdsf",
+	[CACHE_POLICY_GDSF_BYTES] = "gdsf-bytes",
+};
+
+static char *watch = "none";
+
+static const char *watch_names[] = {
+	[WATCH_NONE] = "none",
+	[WATCH_INOTIFY] = "inotify",
+	[WATCH_FANOTIFY] = "fanotify",
+};
+
+/* returns the index of name in names, or -1 */
+static int
+parse_name(const char *name, const char *names[], int nr_names)
+{
+	int i;
+
+	for (i = 0; i < nr_names; i++) {
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int
+parse_policy(const char *name)
+{
+	return parse_name(name, policy_names,
+			  sizeof(policy_names) / sizeof(policy_names[0]));
+}
+
+/* parses a size in bytes, optionally with a K, M, G or T suffix (powers of
+ * 1024). returns -1 if it is not one. */
+static long
+parse_size(const char *arg)
+{
+	const char *suffixes = "KMGT";
+	const char *s;
+	char *end;
+	long long size;
+
+	errno = 0;
+	size = strtoll(arg, &end, 10);
+	if (end == arg || errno != 0 || size < 0)
+		return -1;
+	if (*end != '\0') {
+		if ((s = strchr(suffixes, toupper((unsigned char)*end))) == NULL ||
+		    end[1] != '\0')
+			return -1;
+		for (; s >= suffixes; s--) {
+			if (size > LLONG_MAX / 1024)
+				return -1;
+			size *= 1024;
+		}
+	}
+	return size;
+}
+
 static char *fifo = "./server_exit";
 
 /* we will use this fifo to send a message to the server to exit */
@@ -53,30 +121,143 @@ close_fifo(void)
 }
 
 int
-main(int argc, char *argv[])
+main(int argc, const char *argv[])
 {
-	int port, nr_threads, max_requests, max_cache_size;
+	int port, nr_threads, max_requests;
+	long max_cache_size;
 	int listenfd, connfd, clientlen;
 	int exitfd;
 	struct sockaddr_in clientaddr;
 	struct server *sv;
+	struct server_options opts;
+	const char **args;
+	int c, nr_args;
+
+	struct poptOption options_table[] = {
+		{"policy", 'p', POPT_ARG_STRING, &policy, 'p',
+		 "cache replacement policy: lru, gdsf (object hit ratio) or "
+		 "gdsf-bytes (byte hit ratio)",
+		 " default: gdsf"},
+		{"mmap", 'm', POPT_ARG_NONE, &opts.cache_mmap, 0,
+		 "cache read-only mappings of files, sharing the page cache",
+		 NULL},
+		{"mlock", 'l', POPT_ARG_NONE, &opts.cache_mlock, 0,
+		 "with --mmap, prefault and lock the cached mappings", NULL},
+		{"hugepages", 'H', POPT_ARG_NONE, &opts.cache_hugepages, 0,
+		 "allocate the cache from huge pages (MAP_HUGETLB, or "
+		 "transparent huge pages when none are reserved)", NULL},
+		{"tlb-stats", 0, POPT_ARG_NONE, &opts.tlb_stats, 0,
+		 "count dTLB misses on the cache hit path", NULL},
+		{"compress", 'z', POPT_ARG_NONE, &opts.cache_compress, 0,
+		 "compress cold cache entries before evicting them", NULL},
+		{"promote-hits", 0, POPT_ARG_INT, &opts.promote_hits, 0,
+		 "hits after which a compressed entry is decompressed for good",
+		 " default: 2"},
+		{"spill", 's', POPT_ARG_STRING, &opts.spill_path, 0,
+		 "keep evicted files in this local file, a second cache tier",
+		 NULL},
+		{"spill-size", 0, POPT_ARG_LONG, &opts.spill_size, 0,
+		 "size of the spill file in bytes", " default: 1GB"},
+		{"watch", 'w', POPT_ARG_STRING, &watch, 0,
+		 "drop cached files when they change: none, inotify or fanotify "
+		 "(file writes only, needs CAP_SYS_ADMIN)", " default: none"},
+		{"warmup", 0, POPT_ARG_STRING, &opts.warmup_path, 0,
+		 "load the files listed in this manifest (a fileset index or a "
+		 "hot list, hottest first) into the cache at startup", NULL},
+		{"warmup-threads", 0, POPT_ARG_INT, &opts.warmup_threads, 0,
+		 "threads that load the warmup files", " default: 2"},
+		{"warmup-rate", 0, POPT_ARG_LONG, &opts.warmup_bandwidth, 0,
+		 "bytes per second the warmup may read, 0 for no limit",
+		 " default: 32MB"},
+		{"prefetch", 0, POPT_ARG_NONE, &opts.prefetch, 0,
+		 "learn which file each client asks for next, and load likely "
+		 "next files into the cache", NULL},
+		{"prefetch-rate", 0, POPT_ARG_LONG, &opts.prefetch_bandwidth, 0,
+		 "bytes per second the prefetcher may read, 0 for no limit",
+		 " default: 16MB"},
+		{"prefetch-budget", 0, POPT_ARG_LONG, &opts.prefetch_budget, 0,
+		 "bytes of prefetched files that may wait in the cache unused",
+		 " default: max_cache_size / 8"},
+		{"negative-ttl", 0, POPT_ARG_DOUBLE, &opts.negative_ttl, 0,
+		 "seconds for which 404 and 403 responses are cached, 0 to not "
+		 "cache them", " default: 0"},
+		{"negative-entries", 0, POPT_ARG_INT, &opts.negative_entries, 0,
+		 "number of 404 and 403 responses cached", " default: 65536"},
+		{"mrc", 0, POPT_ARG_NONE, &opts.mrc, 0,
+		 "estimate the miss ratio of an LRU cache of every size from "
+		 "the requests, printed on exit", NULL},
+		{"block-size", 0, POPT_ARG_INT, &opts.block_size, 0,
+		 "cache files larger than 16 blocks in blocks of this size, "
+		 "0 to cache them whole", " default: 0"},
+		{"reclaim", 0, POPT_ARG_NONE, &opts.reclaim, 0,
+		 "evict in the background to keep part of the cache free",
+		 NULL},
+		{"reclaim-low", 0, POPT_ARG_INT, &opts.reclaim_low, 0,
+		 "start evicting when less than this percentage is free",
+		 " default: 5"},
+		{"reclaim-high", 0, POPT_ARG_INT, &opts.reclaim_high, 0,
+		 "stop evicting when this percentage is free", " default: 10"},
+		{"adaptive", 0, POPT_ARG_NONE, &opts.adaptive, 0,
+		 "shrink the cache under memory pressure, and grow it back up "
+		 "to max_cache_size when memory is free", NULL},
+		{"adaptive-min", 0, POPT_ARG_LONG, &opts.adaptive_min, 0,
+		 "smallest size of an adaptive cache",
+		 " default: max_cache_size / 8"},
+		{"stream-size", 0, POPT_ARG_LONG, &opts.stream_size, 0,
+		 "send files of this many bytes or more that won't be cached "
+		 "a chunk at a time as they are read, 0 to read them whole",
+		 " default: 0"},
+		{"access-log", 0, POPT_ARG_STRING, &opts.access_log, 0,
+		 "append a line for each request to this file", NULL},
+		POPT_AUTOHELP {NULL, 0, 0, NULL, 0}
+	};
+
+	server_options_init(&opts);
+	context = poptGetContext(NULL, argc, argv, options_table, 0);
+	while ((c = poptGetNextOpt(context)) >= 0);
+	if (c < -1) {	/* an error occurred during option processing */
+		fprintf(stderr, "%s: %s\n",
+			poptBadOption(context, POPT_BADOPTION_NOALIAS),
+			poptStrerror(c));
+		exit(1);
+	}
+	if ((c = parse_policy(policy)) < 0) {
+		fprintf(stderr, "unknown cache policy: %s\n", policy);
+		usage(argv[0]);
+	}
+	opts.policy = c;
+	c = parse_name(watch, watch_names,
+		       sizeof(watch_names) / sizeof(watch_names[0]));
+	if (c < 0) {
+		fprintf(stderr, "unknown watch mode: %s\n", watch);
+		usage(argv[0]);
+	}
+	opts.watch = c;
 
-	if (argc != 5)
+	args = poptGetArgs(context);
+	for (nr_args = 0; args && args[nr_args]; nr_args++);
+	if (nr_args != 4)
 		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	port = atoi(args[0]);
+	nr_threads = atoi(args[1]);
+	max_requests = atoi(args[2]);
+	max_cache_size = parse_size(args[3]);
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
 		usage(argv[0]);
 	}
-	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0) {
+	if (max_cache_size < 0) {
+		fprintf(stderr, "max_cache_size = %s, should be a number of "
+			"bytes, optionally with a K, M, G or T suffix\n",
+			args[3]);
+		usage(argv[0]);
+	}
+	if (nr_threads < 0 || max_requests < 0) {
 		fprintf(stderr, "arguments should be > 0\n");
 		usage(argv[0]);
 	}
 
-	sv = server_init(nr_threads, max_requests, max_cache_size);
+	sv = server_init(nr_threads, max_requests, max_cache_size, &opts);
 
 	listenfd = open_listenfd(port);
 	exitfd = open_fifo();
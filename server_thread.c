@@ -1,38 +1,168 @@
 #include "request.h"
 #include "server_thread.h"
 #include "common.h"
-
-#define TABLE_SIZE 9000000
-
-typedef struct node {
-	int fkey;
-	struct node* next;
-} node;
-
-typedef struct queue {
-	node *head;
-	int size; 
-} queue;
+#include "arena.h"
+#include "lz.h"
+#include "spill.h"
+#include "watch.h"
+#include "warmup.h"
+#include "prefetch.h"
+#include "negcache.h"
+#include "mrc.h"
+#include "pressure.h"
+#include "accesslog.h"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <limits.h>
+
+/* the table starts out with this many slots, and doubles whenever it gets
+ * half full so that probe sequences stay short */
+#define TABLE_MIN_SIZE (1 << 16)
+/* slots of the old table moved to the new one by each insert while the
+ * table grows. a grow comes after at least half as many inserts as the old
+ * table has slots, so more than 2 makes sure the move is done by then. */
+#define TABLE_MIGRATE 64
 
 typedef struct fentry {
 	char *fname;
-	struct file_data *fdata;
-	int in_use;
+	struct file_data *fdata;	/* the cache holds a reference to it */
+	long charge;		/* bytes counted against the cache size */
+	long home;		/* slot the name hashes to */
+	int freq;		/* number of requests while cached */
+	double priority;	/* eviction key, the lowest is evicted first */
+	int heap_idx;		/* position in the eviction heap */
+	int zstate;		/* ZSTATE_*, for the compressed tier */
+	int zhits;		/* hits since the body was compressed */
+	int prefetched;		/* loaded by the prefetcher and not used yet */
+	int is_block;		/* holds one block of a large file */
+	unsigned long block_id;	/* for a file cached in blocks, see block_key */
+	int spill;		/* evicted, and to be spilled when it is freed */
+	unsigned long generation; /* of the cache, when it was evicted */
+	struct fentry *next;	/* used to collect entries to drop */
 } fentry;
 
+/* entries start out raw. when they reach the bottom of the eviction heap they
+ * are queued for the reclaimer to compress and get a second chance, and only
+ * compressed (or incompressible) entries are evicted. */
+#define ZSTATE_RAW		0
+#define ZSTATE_PACKED		1
+#define ZSTATE_INCOMPRESSIBLE	2
+#define ZSTATE_PACKING		3	/* queued, and out of the eviction heap */
+
+/* smaller bodies are not worth compressing */
+#define ZMIN_SIZE		512
+
+/* files with more blocks than this are cached in blocks */
+#define BLOCK_MIN_BLOCKS	16
+
+/* entries the reclaimer looks at before letting go of cache_l */
+#define RECLAIM_BATCH		32
+
+/* entries that can wait for the reclaimer to compress them */
+#define PACK_QUEUE		64
+
+/* binary min-heap of entries, ordered by priority */
+typedef struct heap {
+	fentry **items;
+	int size;
+	int capacity;
+} heap;
+
+struct cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	unsigned long evictions;
+	unsigned long long hit_bytes;
+	unsigned long long miss_bytes;
+	unsigned long long hit_tlb_misses; /* dTLB misses on the hit path */
+	unsigned long tlb_hits;		   /* hits that were measured */
+	unsigned long demotions;	/* entries compressed */
+	unsigned long promotions;	/* entries decompressed for good */
+	unsigned long packed_hits;	/* hits on compressed entries */
+	unsigned long not_modified;	/* hits answered with a 304 */
+	unsigned long disk_ranges;	/* misses for ranges, sent from disk */
+	unsigned long encoded;		/* hits that sent a precompressed copy */
+	unsigned long streamed;		/* misses sent as they were read */
+	unsigned long incompressible;	/* entries that did not compress */
+	unsigned long invalidations;	/* entries dropped because they changed */
+	unsigned long warmed;		/* entries loaded from the warmup manifest */
+	unsigned long prefetched;	/* entries loaded by the prefetcher */
+	unsigned long prefetch_hits;	/* of those, entries that were used */
+	unsigned long prefetch_waste;	/* entries that left the cache unused */
+	unsigned long block_hits;	/* blocks of large files sent from memory */
+	unsigned long block_misses;	/* and read from the disk */
+	unsigned long block_inserts;
+	unsigned long reclaimed;	/* entries evicted by the reclaimer */
+	unsigned long reclaim_batches;
+	unsigned long inline_evictions;	/* made by an insert that was short */
+};
+
 typedef struct cache {
-	int size; 
-	int max_cache_size;
-	int table_size;
-	queue *lru_queue;
+	long size; 
+	long max_cache_size;
+	long table_size;
+	long nr_entries;	/* in both tables */
+	enum cache_policy policy;
+	double inflation;	/* GDSF aging value L, priority of last victim */
+	unsigned long clock;	/* LRU timestamp */
+	int compress;		/* compress entries instead of evicting them */
+	int promote_hits;	/* hits that decompress an entry for good */
+	unsigned long generation; /* bumped whenever files change on disk */
+	long prefetch_bytes;	/* size of the prefetched entries not used yet */
+	long prefetch_budget;	/* limit on prefetch_bytes */
+	int block_size;		/* of large files, 0 to cache them whole */
+	unsigned long block_ids; /* last block_id handed out */
+	/* the reclaimer evicts in the background once less than reclaim_low
+	 * bytes are free, until reclaim_high bytes are free again */
+	int reclaim;
+	long reclaim_low;
+	long reclaim_high;
+	int reclaim_low_pct;	/* of max_cache_size, which can change */
+	int reclaim_high_pct;
+	int reclaiming;		/* between the two watermarks */
+	int reclaim_stop;
+	int trim;		/* the budget shrank, the reclaimer is to give
+				 * the arena's empty slabs back once it got
+				 * under it */
+	pthread_t reclaimer;
+	pthread_cond_t reclaim_cond;	/* with cache_l */
+	int background;		/* the reclaimer runs, to evict if reclaim is
+				 * set, to compress what is queued, and to
+				 * spill and free what is released */
+	fentry *released;	/* evicted entries the reclaimer frees */
+	/* bodies of the entries the reclaimer is to compress, it holds a
+	 * reference to each */
+	struct file_data *packing[PACK_QUEUE];
+	int nr_packing;
+	heap *evict_heap;
 	struct fentry **ftable;
+	/* while the table grows, the entries not moved yet, see table_grow */
+	struct fentry **old_ftable;
+	long old_table_size;
+	long migrated;		/* slots of it that are empty for good */
+	struct cache_stats stats;
 } cache;
 
 struct server {
 	int nr_threads;
 	int max_requests;
-	int max_cache_size;
+	long max_cache_size;
+	enum file_storage storage; // how cached file bodies are held
+	int storage_mlock;
+	int hugepages; // cache memory comes from 2MB pages
+	int tlb_stats; // count dTLB misses on the hit path
+	long stream_size; // larger files that won't be cached are streamed
 	int exiting;
+	struct arena *arena; // cached file bodies are allocated from here
+	struct spill *spill; // evicted files go here, if not NULL
+	struct watch *watch; // reports changes to files, if not NULL
+	struct warmup *warmup; // loads files at startup, if not NULL
+	struct prefetch *prefetch; // loads files before they are requested
+	struct negcache *negative; // error responses for missing files
+	struct mrc *mrc; // estimates the miss ratio of other cache sizes
+	struct pressure *pressure; // adapts the cache size, if not NULL
+	struct accesslog *log; // where requests are logged, if not NULL
 	pthread_t **worker_pool; //array of worker threads
 	int *buffer; // the actual buffer of fds
 	int in; 
@@ -50,13 +180,67 @@ pthread_cond_t empty;
 
 
 fentry *cache_lookup(struct server *sv, char *fname);
-int cache_evict(struct server *sv, int reqsize );
-int table_delete(struct server *sv, int reqsize);
+int cache_evict(struct server *sv, long reqsize );
+int table_delete(struct server *sv, long reqsize);
 fentry *cache_insert(struct server *sv, struct file_data *fdata);
 fentry* table_insert(struct server *sv, struct file_data *fdata);
+static struct file_data *file_data_init(struct server *sv);
+static struct file_data *file_data_copy(struct server *sv,
+				       const struct file_data *data);
+static void file_data_get(struct file_data *data);
+static void file_data_put(struct file_data *data);
+static void cache_release(struct server *sv, fentry *entry);
+
+/* the watermarks follow the cache size */
+static void cache_set_watermarks(cache *cache) {
+	cache->reclaim_low = cache->reclaim_high = 0;
+	if (!cache->reclaim) return;
+	cache->reclaim_low =
+		cache->max_cache_size * cache->reclaim_low_pct / 100;
+	cache->reclaim_high =
+		cache->max_cache_size * cache->reclaim_high_pct / 100;
+	if (cache->reclaim_high < cache->reclaim_low)
+		cache->reclaim_high = cache->reclaim_low;
+}
+
+/* returns 1 if a file of size bytes is cached in blocks */
+static int cache_blocked(cache *cache, long size) {
+	return cache->block_size > 0 &&
+		size > (long)BLOCK_MIN_BLOCKS * cache->block_size;
+}
+
+void server_options_init(struct server_options *opts) {
+	opts->policy = CACHE_POLICY_GDSF;
+	opts->cache_mmap = 0;
+	opts->cache_mlock = 0;
+	opts->cache_hugepages = 0;
+	opts->tlb_stats = 0;
+	opts->cache_compress = 0;
+	opts->promote_hits = 2;
+	opts->spill_path = NULL;
+	opts->spill_size = 1L << 30;
+	opts->watch = WATCH_NONE;
+	opts->warmup_path = NULL;
+	opts->warmup_threads = 2;
+	opts->warmup_bandwidth = 32L << 20;
+	opts->prefetch = 0;
+	opts->prefetch_bandwidth = 16L << 20;
+	opts->prefetch_budget = 0;
+	opts->negative_ttl = 0;
+	opts->negative_entries = 65536;
+	opts->mrc = 0;
+	opts->block_size = 0;
+	opts->reclaim = 0;
+	opts->reclaim_low = 5;
+	opts->reclaim_high = 10;
+	opts->adaptive = 0;
+	opts->adaptive_min = 0;
+	opts->stream_size = 0;
+	opts->access_log = NULL;
+}
 
 void server_initalization(struct server *sv, int nr_threads, 
-    int max_requests, int max_cache_size) {
+    int max_requests, long max_cache_size, struct server_options *opts) {
     
     sv->nr_threads = nr_threads;
     sv->buffer = NULL;
@@ -67,141 +251,973 @@ void server_initalization(struct server *sv, int nr_threads,
     sv->max_requests = max_requests;
     sv->max_cache_size = max_cache_size;
     sv->out = 0;
+    sv->hugepages = opts->cache_hugepages;
+    sv->spill = NULL;
+    sv->watch = NULL;
+    sv->warmup = NULL;
+    sv->prefetch = NULL;
+    sv->negative = NULL;
+    sv->pressure = NULL;
+    sv->log = NULL;
+    sv->mrc = opts->mrc ? mrc_init() : NULL;
+    sv->tlb_stats = opts->tlb_stats;
+    sv->stream_size = opts->stream_size;
     if (max_cache_size > 0 ) {
+        if (opts->cache_mmap) {
+            sv->arena = NULL;
+            sv->storage = FILE_STORAGE_MMAP;
+            sv->storage_mlock = opts->cache_mlock;
+        } else {
+            sv->arena = arena_init(opts->cache_hugepages);
+            sv->storage = FILE_STORAGE_ARENA;
+            sv->storage_mlock = 0;
+        }
         sv->cache = (cache *)malloc(sizeof(cache));
-        sv->cache->table_size = TABLE_SIZE;
-        sv->cache->lru_queue = (queue *)malloc(sizeof(queue));
-        sv->cache->ftable = (fentry **)malloc(TABLE_SIZE*sizeof(fentry*));
+        sv->cache->table_size = TABLE_MIN_SIZE;
+        sv->cache->nr_entries = 0;
+        sv->cache->evict_heap = (heap *)malloc(sizeof(heap));
+        sv->cache->evict_heap->size = 0;
+        sv->cache->evict_heap->capacity = 0;
+        sv->cache->evict_heap->items = NULL;
+        /* mapped memory is already zeroed, so every slot is NULL */
+        sv->cache->ftable = (fentry **)arena_map_pages(
+            TABLE_MIN_SIZE*sizeof(fentry*), opts->cache_hugepages);
+        sv->cache->old_ftable = NULL;
+        sv->cache->old_table_size = 0;
+        sv->cache->migrated = 0;
         sv->cache->size = 0;
         sv->cache->max_cache_size = max_cache_size;
-
-        for (int i = 0; i < TABLE_SIZE; i++) {
-            sv->cache->ftable[i] = NULL;
-        }
+        sv->cache->policy = opts->policy;
+        sv->cache->inflation = 0;
+        sv->cache->clock = 0;
+        sv->cache->generation = 0;
+        /* mappings belong to the page cache, they are never compressed */
+        sv->cache->compress = opts->cache_compress && !opts->cache_mmap;
+        sv->cache->promote_hits = opts->promote_hits;
+        sv->cache->prefetch_bytes = 0;
+        sv->cache->prefetch_budget = opts->prefetch_budget > 0 ?
+            opts->prefetch_budget : max_cache_size / 8;
+        /* a mapping of a large file is paged in on demand anyway */
+        sv->cache->block_size = opts->cache_mmap ? 0 : opts->block_size;
+        sv->cache->block_ids = 0;
+        /* a budget that adapts relies on the reclaimer to shrink */
+        sv->cache->reclaim = opts->reclaim || opts->adaptive;
+        sv->cache->reclaim_low_pct = opts->reclaim_low;
+        sv->cache->reclaim_high_pct = opts->reclaim_high;
+        cache_set_watermarks(sv->cache);
+        sv->cache->reclaiming = 0;
+        sv->cache->reclaim_stop = 0;
+        sv->cache->trim = 0;
+        /* inserts signal it whether or not the reclaimer runs, from before
+         * it is started */
+        pthread_cond_init(&sv->cache->reclaim_cond, NULL);
+        sv->cache->released = NULL;
+        sv->cache->nr_packing = 0;
+        /* a mapping is already backed by the file itself */
+        if (opts->spill_path != NULL && !opts->cache_mmap)
+            sv->spill = spill_init(opts->spill_path, opts->spill_size);
+        /* compressing and spilling go through the whole body, which is
+         * left to the reclaimer so that it is done without cache_l */
+        sv->cache->background = sv->cache->reclaim || sv->cache->compress ||
+            sv->spill != NULL;
+        if (opts->negative_ttl > 0)
+            sv->negative = negcache_init(opts->negative_entries,
+                                         opts->negative_ttl);
+        memset(&sv->cache->stats, 0, sizeof(struct cache_stats));
     } else { 
+        sv->arena = NULL;
+        sv->storage = FILE_STORAGE_HEAP;
+        sv->storage_mlock = 0;
         sv->cache = NULL;
     }
 }
 
-void insert_front(queue *ll, int fkey) {
-	if (ll == NULL) return;
-	
-	node *new_node = (node *)malloc(sizeof(node));
-	new_node->fkey = fkey;
-	new_node->next = NULL;
+static void heap_swap(heap *h, int a, int b) {
+	fentry *tmp = h->items[a];
+	h->items[a] = h->items[b];
+	h->items[b] = tmp;
+	h->items[a]->heap_idx = a;
+	h->items[b]->heap_idx = b;
+}
 
-	if (ll->head == NULL) {
-		ll->head = new_node;
-		(ll->size)++;
-		return;
-	} else {
-		new_node->next = ll->head;
-		ll->head = new_node;
-		(ll->size)++;
-		return;
+static void heap_up(heap *h, int i) {
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (h->items[parent]->priority <= h->items[i]->priority) break;
+		heap_swap(h, parent, i);
+		i = parent;
 	}
-	return;
 }
 
-void insert_end(queue *ll, int fkey) {
-	if (ll == NULL) return; 
+static void heap_down(heap *h, int i) {
+	while (1) {
+		int left = 2 * i + 1, right = left + 1, min = i;
+		if (left < h->size && h->items[left]->priority < h->items[min]->priority)
+			min = left;
+		if (right < h->size && h->items[right]->priority < h->items[min]->priority)
+			min = right;
+		if (min == i) break;
+		heap_swap(h, min, i);
+		i = min;
+	}
+}
 
-	node *new_node = (node *)malloc(sizeof(node));
-	new_node->fkey = fkey;
-	new_node->next = NULL;
+void heap_push(heap *h, fentry *entry) {
+	if (h->size == h->capacity) {
+		h->capacity = h->capacity ? 2 * h->capacity : 1024;
+		h->items = (fentry **)realloc(h->items, h->capacity*sizeof(fentry*));
+		if (h->items == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	entry->heap_idx = h->size;
+	h->items[h->size++] = entry;
+	heap_up(h, entry->heap_idx);
+}
+
+/* entries waiting to be compressed are not in the heap */
+void heap_remove(heap *h, fentry *entry) {
+	int i = entry->heap_idx;
+	if (i < 0) return;
+	h->size--;
+	if (i != h->size) {
+		fentry *moved = h->items[h->size];
+		heap_swap(h, i, h->size);
+		heap_up(h, i);
+		heap_down(h, moved->heap_idx);
+	}
+	entry->heap_idx = -1;
+}
+
+/* call after changing entry->priority */
+void heap_fix(heap *h, fentry *entry) {
+	if (entry->heap_idx < 0) return;
+	heap_up(h, entry->heap_idx);
+	heap_down(h, entry->heap_idx);
+}
 
-	if (ll->head == NULL) {
-		ll->head = new_node; 
-		(ll->size)++;
+/* bytes that an entry takes up in memory besides its body: the entry, its
+ * file data, both copies of the name, its slot in the eviction heap and
+ * about one slot in the table. with millions of small files this is a good
+ * part of the total. */
+static long entry_overhead(struct file_data *fdata) {
+	return sizeof(struct fentry) + sizeof(struct file_data) +
+		2 * (strlen(fdata->file_name) + 1) + 2 * sizeof(fentry *);
+}
+
+/* bytes that the body of fdata takes up in memory, and its entry */
+long get_charge(struct server *sv, struct file_data *fdata) {
+	long page = sysconf(_SC_PAGESIZE);
+	long body;
+
+	if (fdata->file_blocks > 0)
+		body = 0;
+	else if (fdata->file_storage == FILE_STORAGE_MMAP)
+		body = (fdata->file_size + page - 1) / page * page;
+	else if (fdata->file_zsize > 0)
+		body = arena_charge(fdata->file_arena, fdata->file_zsize);
+	else if (fdata->file_storage == FILE_STORAGE_ARENA)
+		body = arena_charge(fdata->file_arena, fdata->file_size);
+	else
+		body = fdata->file_size;
+	return body + entry_overhead(fdata);
+}
+
+/* GDSF: H = L + freq * cost / size, where size is the memory the entry takes
+ * up, so a compressed entry is cheaper to keep. With cost = 1 small files are favoured,
+ * maximizing the object hit ratio. With cost = size the size cancels out
+ * (LFU with aging), which maximizes the byte hit ratio instead. */
+double get_priority(cache *cache, fentry *entry) {
+	double size = entry->charge > 0 ? entry->charge : 1;
+
+	switch (cache->policy) {
+	case CACHE_POLICY_LRU:
+		return (double)(++cache->clock);
+	case CACHE_POLICY_GDSF_BYTES:
+		return cache->inflation + entry->freq;
+	case CACHE_POLICY_GDSF:
+	default:
+		return cache->inflation + entry->freq / size;
+	}
+}
+
+/* file was requested again, move it away from eviction */
+void update(struct server *sv, fentry *entry) {
+	entry->freq++;
+	entry->priority = get_priority(sv->cache, entry);
+	heap_fix(sv->cache->evict_heap, entry);
+}
+
+static unsigned long name_hash(const char *fname) {
+	unsigned long hash = 5381;
+	int c;
+	while ((c = *fname++) != '\0') {
+		hash = ((hash << 5) + hash) + c;
+	}
+	/* mix, the table size is a power of two */
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdUL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+long get_hash(struct server *sv, char *fname) {
+	return (long)(name_hash(fname) % sv->cache->table_size);
+}
+
+/* returns the slot of fname in table, which has size slots, or -1 */
+static long table_find(fentry **table, long size, unsigned long hash,
+		       const char *fname) {
+	long slot = hash % size;
+
+	for (; table[slot] != NULL; slot = (slot + 1) % size) {
+		if (strcmp(table[slot]->fname, fname) == 0) return slot;
+	}
+	return -1;
+}
+
+/* while the table grows, entries not moved yet are in the old table */
+fentry *cache_lookup(struct server *sv, char *fname) {
+	cache *cache = sv->cache;
+	unsigned long hash = name_hash(fname);
+	long slot;
+
+	if ((slot = table_find(cache->ftable, cache->table_size, hash,
+			       fname)) >= 0)
+		return cache->ftable[slot];
+	if (cache->old_ftable != NULL &&
+	    (slot = table_find(cache->old_ftable, cache->old_table_size, hash,
+			       fname)) >= 0)
+		return cache->old_ftable[slot];
+	return NULL;
+}
+
+/* returns the slot of entry in table, or -1 if it is not in it. entry->home
+ * is the slot it hashes to in the table it is in. */
+static long table_slot(fentry **table, long size, fentry *entry) {
+	long slot = entry->home;
+
+	for (; table[slot] != NULL; slot = (slot + 1) % size) {
+		if (table[slot] == entry) return slot;
+	}
+	return -1;
+}
+
+/* empties slot hole of table. entries further along the probe sequence are
+ * shifted back so that lookups never stop early at the hole. */
+static void table_unlink(fentry **table, long size, long hole) {
+	long next;
+
+	table[hole] = NULL;
+	next = hole;
+	while (1) {
+		next = (next + 1) % size;
+		fentry *item = table[next];
+		if (item == NULL) break;
+		/* item can stay if its home lies cyclically in (hole, next] */
+		if (hole <= next) {
+			if (item->home > hole && item->home <= next) continue;
+		} else {
+			if (item->home > hole || item->home <= next) continue;
+		}
+		table[hole] = item;
+		table[next] = NULL;
+		hole = next;
+	}
+}
+
+/* remove entry from the table, or from the old one if it is still there */
+void table_remove(struct server *sv, fentry *entry) {
+	cache *cache = sv->cache;
+	long slot = -1;
+
+	if (cache->old_ftable != NULL && entry->home < cache->old_table_size)
+		slot = table_slot(cache->old_ftable, cache->old_table_size,
+				  entry);
+	if (slot >= 0)
+		table_unlink(cache->old_ftable, cache->old_table_size, slot);
+	else
+		table_unlink(cache->ftable, cache->table_size,
+			     table_slot(cache->ftable, cache->table_size,
+					entry));
+	cache->nr_entries--;
+}
+
+/* moves the entries in the next n slots of the old table to the new one,
+ * and lets go of the old table once it is empty. an entry is taken out as
+ * table_remove does it, so the ones after it may shift back into its slot,
+ * and the slot is only done with once it stays empty. */
+static void table_migrate(struct server *sv, long n) {
+	cache *cache = sv->cache;
+	fentry **old = cache->old_ftable;
+	fentry *entry;
+	long slot;
+
+	for (; n > 0 && cache->migrated < cache->old_table_size; n--) {
+		while ((entry = old[cache->migrated]) != NULL) {
+			table_unlink(old, cache->old_table_size,
+				     cache->migrated);
+			entry->home = slot = get_hash(sv, entry->fname);
+			while (cache->ftable[slot] != NULL)
+				slot = (slot + 1) % cache->table_size;
+			cache->ftable[slot] = entry;
+		}
+		cache->migrated++;
+	}
+	if (cache->migrated == cache->old_table_size) {
+		arena_unmap_pages(old, cache->old_table_size * sizeof(fentry *),
+				  sv->hugepages);
+		cache->old_ftable = NULL;
+	}
+}
+
+/* doubles the table. placing every entry again takes a while with millions
+ * of them, so the old table is kept and inserts move its entries over a few
+ * slots at a time, see table_migrate. lookups look in both until then. */
+static void table_grow(struct server *sv) {
+	cache *cache = sv->cache;
+
+	/* only if the inserts were too few to finish the last move */
+	if (cache->old_ftable != NULL)
+		table_migrate(sv, cache->old_table_size);
+	cache->old_ftable = cache->ftable;
+	cache->old_table_size = cache->table_size;
+	cache->migrated = 0;
+	cache->table_size *= 2;
+	cache->ftable = (fentry **)arena_map_pages(
+		cache->table_size * sizeof(fentry *), sv->hugepages);
+}
+
+/* the body is freed once the requests still sending it are done */
+static void entry_free(fentry *entry) {
+	file_data_put(entry->fdata);
+	free(entry->fname);
+	free(entry);
+}
+
+/* frees an entry that left the cache. with the reclaimer running that is
+ * left to it, so that requests don't spend time freeing under cache_l. */
+static void cache_release(struct server *sv, fentry *entry) {
+	if (!sv->cache->background) {
+		entry_free(entry);
 		return;
+	}
+	entry->next = sv->cache->released;
+	sv->cache->released = entry;
+	pthread_cond_signal(&sv->cache->reclaim_cond);
+}
+
+/* remembers the error that request_readfile sent for rq, unless files
+ * changed since the lookup at generation. the watcher drops negative entries
+ * under cache_l too, so one can't be inserted after the change that would
+ * have dropped it. */
+static void cache_negative(struct server *sv, struct request *rq,
+			   const char *name, unsigned long generation) {
+	char buf[MAXBUF];
+	int size = request_get_error(rq, buf, sizeof(buf));
+
+	if (size == 0) return;
+	pthread_mutex_lock(&cache_l);
+	if (generation == sv->cache->generation)
+		negcache_insert(sv->negative, name, buf, size);
+	pthread_mutex_unlock(&cache_l);
+}
+
+/* a prefetched entry was requested, or is leaving the cache without ever
+ * having been requested */
+static void cache_prefetch_done(cache *cache, fentry *entry, int used) {
+	if (!entry->prefetched) return;
+	entry->prefetched = 0;
+	cache->prefetch_bytes -= entry->fdata->file_size;
+	if (used) cache->stats.prefetch_hits++;
+	else cache->stats.prefetch_waste++;
+}
+
+/* takes entry out of the cache because its file changed */
+static void cache_drop(struct server *sv, fentry *entry) {
+	heap_remove(sv->cache->evict_heap, entry);
+	table_remove(sv, entry);
+	sv->cache->size -= entry->charge;
+	sv->cache->stats.invalidations++;
+	cache_prefetch_done(sv->cache, entry, 0);
+	cache_release(sv, entry);
+}
+
+/* adds the entries of table, which has size slots, for files under path to
+ * list, or all of them if path is "." */
+static fentry *cache_collect(fentry **table, long size, const char *path,
+			     fentry *list) {
+	size_t len = strlen(path);
+	fentry *entry;
+	long i;
+
+	for (i = 0; i < size; i++) {
+		entry = table[i];
+		if (entry != NULL && (strcmp(path, ".") == 0 ||
+		    (strncmp(entry->fname, path, len) == 0 &&
+		     entry->fname[len] == '/'))) {
+			entry->next = list;
+			list = entry;
+		}
+	}
+	return list;
+}
+
+/* called by the watcher thread when files under the document root change */
+static void cache_changed(void *arg, const char *path, int what) {
+	struct server *sv = arg;
+	cache *cache = sv->cache;
+	size_t base;
+	char name[MAXLINE];
+	fentry *entry, *list = NULL;
+	int enc;
+
+	pthread_mutex_lock(&cache_l);
+	/* files read before this point may be old, see do_server_request */
+	sv->cache->generation++;
+	if (what == WATCH_FILE) {
+		entry = cache_lookup(sv, (char *)path);
+		if (entry != NULL) cache_drop(sv, entry);
+		/* the file knows which copies of it there are */
+		if ((base = request_sidecar_base(path)) > 0 &&
+		    base < sizeof(name)) {
+			memcpy(name, path, base);
+			name[base] = '\0';
+			entry = cache_lookup(sv, name);
+			if (entry != NULL) cache_drop(sv, entry);
+		}
+		/* and its copies may be older than it now, see
+		 * cache_negotiate */
+		for (enc = 1; base == 0 && enc <= FILE_ENC_ALL; enc <<= 1) {
+			if (request_sidecar_name(path, enc, name, sizeof(name)) &&
+			    (entry = cache_lookup(sv, name)) != NULL)
+				cache_drop(sv, entry);
+		}
 	} else {
-		node *tmp;
-		tmp = ll->head;
-		while (tmp->next != NULL) {
-			tmp = tmp->next;
+		/* collect first, dropping shifts entries in the table. the
+		 * table has the entries waiting to be compressed too, which
+		 * are out of the eviction heap. */
+		list = cache_collect(cache->ftable, cache->table_size, path,
+				     list);
+		if (cache->old_ftable != NULL)
+			list = cache_collect(cache->old_ftable,
+					     cache->old_table_size, path, list);
+		while (list != NULL) {
+			entry = list;
+			list = list->next;
+			cache_drop(sv, entry);
+		}
+	}
+	/* under cache_l, see cache_negative */
+	if (sv->negative != NULL)
+		negcache_remove(sv->negative, path, what == WATCH_TREE);
+	pthread_mutex_unlock(&cache_l);
+	if (sv->spill != NULL) spill_remove(sv->spill, path, what == WATCH_TREE);
+}
+
+/* reads a file and caches it, for the warmup and prefetch threads. returns
+ * the bytes read. a warmup file is only cached if it fits without evicting
+ * anything, since whatever is cached already came earlier in the manifest
+ * or was requested. a prefetched file may evict, but the prefetched files
+ * that have not been used yet are limited to the prefetch budget. */
+static long cache_load(struct server *sv, const char *path, int prefetch) {
+	cache *cache = sv->cache;
+	struct file_data *data;
+	unsigned long generation;
+	struct stat sbuf;
+	const char *why;
+	fentry *entry;
+	long bytes = 0, room;
+
+	data = file_data_init(sv);
+	request_allocname(data, strlen(path) + 3);
+	request_parse_URI(path, strlen(path), data->file_name,
+			  strlen(path) + 3);
+
+	pthread_mutex_lock(&cache_l);
+	generation = cache->generation;
+	entry = cache_lookup(sv, data->file_name);
+	room = prefetch ? cache->prefetch_budget - cache->prefetch_bytes :
+		cache->max_cache_size - cache->size - cache->reclaim_low;
+	pthread_mutex_unlock(&cache_l);
+	/* the charge is at least the size, so this is a cheap first check.
+	 * large files are left to be cached in blocks when requested. */
+	if (entry != NULL || stat(data->file_name, &sbuf) < 0 ||
+	    sbuf.st_size > room || cache_blocked(sv->cache, sbuf.st_size) ||
+	    request_loadfile(data, &why) != 0) {
+		file_data_put(data);
+		return 0;
+	}
+	bytes = data->file_size;
+
+	pthread_mutex_lock(&cache_l);
+	entry = NULL;
+	/* as for a miss, what was read may be old if files changed */
+	if (generation == cache->generation &&
+	    cache_lookup(sv, data->file_name) == NULL) {
+		/* and not into the headroom the reclaimer keeps */
+		if (!prefetch && cache->max_cache_size - cache->size -
+		    cache->reclaim_low >= get_charge(sv, data)) {
+			entry = table_insert(sv, data);
+			cache->stats.warmed++;
+		} else if (prefetch && cache->prefetch_bytes + data->file_size <=
+			   cache->prefetch_budget &&
+			   cache_evict(sv, get_charge(sv, data)) == 1) {
+			entry = table_insert(sv, data);
+			entry->prefetched = 1;
+			cache->prefetch_bytes += data->file_size;
+			cache->stats.prefetched++;
 		}
-		tmp->next = new_node;
-		(ll->size)++;
+	}
+	pthread_mutex_unlock(&cache_l);
+	file_data_put(data);
+	return bytes;
+}
+
+static long cache_warm(void *arg, const char *path) {
+	return cache_load(arg, path, 0);
+}
+
+static long cache_prefetch(void *arg, const char *path) {
+	return cache_load(arg, path, 1);
+}
+
+/* queues an entry for the reclaimer to compress, returns 1 if it was, or 0
+ * if it has to be evicted. until the reclaimer gets to it the entry is out
+ * of the eviction heap, so that it is not evicted before its second chance.
+ * called with cache_l held. */
+static int cache_queue_demote(struct server *sv, fentry *entry) {
+	struct file_data *data = entry->fdata;
+	cache *cache = sv->cache;
+
+	/* lz.c works on int sizes */
+	if (data->file_storage != FILE_STORAGE_ARENA || data->file_blocks > 0 ||
+	    data->file_size < ZMIN_SIZE || data->file_size > INT_MAX) {
+		entry->zstate = ZSTATE_INCOMPRESSIBLE;
+		cache->stats.incompressible++;
+		return 0;
+	}
+	if (cache->nr_packing == PACK_QUEUE) return 0;
+	file_data_get(data);
+	cache->packing[cache->nr_packing++] = data;
+	entry->zstate = ZSTATE_PACKING;
+	pthread_cond_signal(&cache->reclaim_cond);
+	return 1;
+}
+
+/* compresses a copy of the body of data, without cache_l. returns the copy,
+ * or NULL if that would not save at least an eighth. */
+static struct file_data *cache_pack(struct server *sv,
+				    const struct file_data *data) {
+	struct file_data *packed;
+	int limit, zsize;
+	char *tmp;
+
+	limit = data->file_size - data->file_size / 8;
+	tmp = Malloc(limit);
+	zsize = lz_compress(data->file_buf, data->file_size, tmp, limit);
+	if (zsize == 0) {
+		free(tmp);
+		return NULL;
+	}
+	packed = file_data_copy(sv, data);
+	packed->file_buf = arena_alloc(packed->file_arena, zsize);
+	memcpy(packed->file_buf, tmp, zsize);
+	free(tmp);
+	packed->file_zsize = zsize;
+	return packed;
+}
+
+/* packed is the compressed copy of data from cache_pack, or NULL. if the
+ * entry of data is still cached it gets packed, and goes back into the
+ * eviction heap. requests may still be sending the raw body, so the entry
+ * gets a new file_data and the old one goes when they are done with it.
+ * called with cache_l held. */
+static void cache_demote(struct server *sv, struct file_data *data,
+			 struct file_data *packed) {
+	fentry *entry = cache_lookup(sv, data->file_name);
+
+	if (entry == NULL || entry->fdata != data ||
+	    entry->zstate != ZSTATE_PACKING) {
+		/* it was dropped while it was compressed */
+		if (packed != NULL) file_data_put(packed);
 		return;
 	}
+	if (packed == NULL) {
+		entry->zstate = ZSTATE_INCOMPRESSIBLE;
+		sv->cache->stats.incompressible++;
+	} else {
+		entry->fdata = packed;
+		file_data_put(data);
+		sv->cache->size -= entry->charge;
+		entry->charge = get_charge(sv, packed);
+		sv->cache->size += entry->charge;
+		entry->zstate = ZSTATE_PACKED;
+		entry->zhits = 0;
+		sv->cache->stats.demotions++;
+	}
+	entry->priority = get_priority(sv->cache, entry);
+	heap_push(sv->cache->evict_heap, entry);
 }
 
-void pop_any(queue *ll, int fkey) {
-	if (ll == NULL || ll->head == NULL) return;
+/* raw is the decompressed body of data, from serving a hit on it. if its
+ * entry is still cached and has become hot again it keeps raw instead of
+ * the compressed copy, otherwise raw is freed. called with cache_l held. */
+static void cache_promote(struct server *sv, struct file_data *data,
+			  char *raw) {
+	fentry *entry = cache_lookup(sv, data->file_name);
+	long raw_charge = arena_charge(data->file_arena, data->file_size) +
+		entry_overhead(data);
+	struct file_data *unpacked;
+	int room = 0;
+
+	if (entry != NULL && entry->fdata == data &&
+	    entry->zstate == ZSTATE_PACKED &&
+	    ++entry->zhits >= sv->cache->promote_hits) {
+		/* don't let the entry evict itself */
+		heap_remove(sv->cache->evict_heap, entry);
+		room = cache_evict(sv, raw_charge - entry->charge);
+		heap_push(sv->cache->evict_heap, entry);
+	}
+	if (!room) {
+		arena_free(data->file_arena, raw, data->file_size);
+		return;
+	}
+	/* as in cache_demote, others may still be sending the old copy */
+	unpacked = file_data_copy(sv, data);
+	unpacked->file_buf = raw;
+	entry->fdata = unpacked;
+	file_data_put(data);
+
+	sv->cache->size -= entry->charge;
+	entry->charge = raw_charge;
+	sv->cache->size += entry->charge;
+	entry->zstate = ZSTATE_RAW;
+	entry->priority = get_priority(sv->cache, entry);
+	heap_fix(sv->cache->evict_heap, entry);
+	sv->cache->stats.promotions++;
+}
 
-	node *prev = ll->head;
-	node *curr = ll->head->next;
+/* writes an evicted entry to the spill file, uncompressed so that it can be
+ * read straight back */
+static void cache_spill(struct server *sv, fentry *entry) {
+	struct file_data *data = entry->fdata;
+	char *body;
 
-	if (prev->fkey == fkey){
-		ll->head = ll->head->next;
-		free(prev);
+	if (data->file_zsize == 0) {
+		spill_store(sv->spill, data, data->file_buf);
 		return;
 	}
-	while (curr->next != NULL) {
-		if (curr->fkey == fkey ){
-			prev->next = curr->next;
-			free(curr);
-			(ll->size)--;
-			return;
-		}
-		prev = curr;
-		curr = curr->next;
+	body = Malloc(data->file_size);
+	lz_decompress(data->file_buf, data->file_zsize, body, data->file_size);
+	spill_store(sv->spill, data, body);
+	free(body);
+}
+
+/* blocks of a file are cached under "<name> <block_id> <index>". names
+ * never have spaces in them, the request line is split at spaces. the
+ * block_id is new every time the file is cached, so blocks of an older
+ * version of the file are never found, and are left to be evicted. */
+static void block_key(char *key, size_t max, const struct file_data *meta,
+		      unsigned long block_id, int i) {
+	snprintf(key, max, "%s %lu %d", meta->file_name, block_id, i);
+}
+
+/* caches the entry for a large file that is about to be streamed. the entry
+ * holds what the response header needs but no body, and no checksum until
+ * the file went by whole, see cache_meta_ready. its blocks are cached with
+ * cache_add_block. called with cache_l held. */
+static fentry *cache_insert_meta(struct server *sv, struct file_data *data) {
+	struct file_data *meta;
+	fentry *entry = NULL;
+
+	if (cache_lookup(sv, data->file_name) != NULL) return NULL;
+	meta = file_data_copy(sv, data);
+	meta->file_blocks = (data->file_size + sv->cache->block_size - 1) /
+		sv->cache->block_size;
+	if (cache_evict(sv, get_charge(sv, meta)) == 1) {
+		entry = table_insert(sv, meta);
+		entry->block_id = ++sv->cache->block_ids;
 	}
+	file_data_put(meta);
+	return entry;
 }
 
-void update (struct server *sv, int fkey){
-	pop_any(sv->cache->lru_queue, fkey);
-	insert_end(sv->cache->lru_queue, fkey);
+/* bytes in block i of the file of meta */
+static int block_size(struct server *sv, const struct file_data *meta, int i) {
+	long size = meta->file_size - (long)i * sv->cache->block_size;
+
+	return size < sv->cache->block_size ? size : sv->cache->block_size;
 }
 
-long get_hash(struct server *sv, char *fname) {
-	unsigned long hash = 5381;
-	int c;
-	while ((c = *fname++) != '\0') {
-		hash = ((hash << 5) + hash) + c;
+/* returns 1 if the open file fd is still the version of the file that meta
+ * was made from */
+static int block_file_matches(const struct file_data *meta, int fd) {
+	struct stat sbuf;
+
+	return fstat(fd, &sbuf) == 0 && sbuf.st_ino == meta->file_ino &&
+		sbuf.st_size == meta->file_size &&
+		sbuf.st_mtime == meta->file_mtime &&
+		sbuf.st_mtim.tv_nsec == meta->file_mtime_ns;
+}
+
+/* makes block i of the file of meta, with room for its bytes, which the
+ * caller fills in before it sets file_ready */
+static struct file_data *block_alloc(struct server *sv,
+				     const struct file_data *meta,
+				     unsigned long block_id, int i) {
+	struct file_data *bdata = file_data_init(sv);
+	char key[MAXLINE + 64];
+
+	block_key(key, sizeof(key), meta, block_id, i);
+	strcpy(request_allocname(bdata, strlen(key) + 1), key);
+	bdata->file_size = block_size(sv, meta, i);
+	request_allocbuf(bdata);
+	bdata->file_type = meta->file_type;
+	return bdata;
+}
+
+/* reads block i from the file, which is opened into fd the first time.
+ * returns NULL if the file is gone or is not the one meta describes. */
+static struct file_data *block_read(struct server *sv,
+				    const struct file_data *meta,
+				    unsigned long block_id, int i, int *fd) {
+	struct file_data *bdata = block_alloc(sv, meta, block_id, i);
+	int size = bdata->file_size;
+	ssize_t n;
+	int done;
+
+	if (*fd < 0) {
+		*fd = open(meta->file_name, O_RDONLY);
+		/* the same simulated slow disk as request_readfile */
+		usleep(10000);
+		/* blocks of another version would be spliced into the body
+		 * of this one */
+		if (*fd >= 0 && !block_file_matches(meta, *fd)) {
+			SYS(close(*fd));
+			*fd = -1;
+		}
+	}
+	for (done = 0; *fd >= 0 && done < size; done += n) {
+		n = pread(*fd, bdata->file_buf + done, size - done,
+			  (off_t)i * sv->cache->block_size + done);
+		if (n <= 0) break;
+	}
+	if (*fd < 0 || done < size) {
+		/* the file is gone, changed, or got shorter */
+		file_data_put(bdata);
+		return NULL;
 	}
-	long hash_ret = (long)  hash % TABLE_SIZE;
-	return hash_ret;
+	bdata->file_ready = 1;
+	return bdata;
 }
 
-fentry *cache_lookup(struct server *sv, char *fname) {
-	long hash = get_hash(sv, fname); // get index of the file_name
+/* the file of meta is not the one that was cached under block_id any more,
+ * drops its entry unless it was cached again meanwhile */
+static void cache_drop_blocks(struct server *sv, const struct file_data *meta,
+			      unsigned long block_id) {
+	fentry *entry;
 
-	while(sv->cache->ftable != NULL && sv->cache->ftable[hash] != NULL && strcmp(sv->cache->ftable[hash]->fname, fname) != 0) {
-		hash++;
-		hash = hash % TABLE_SIZE ;
+	pthread_mutex_lock(&cache_l);
+	entry = cache_lookup(sv, meta->file_name);
+	if (entry != NULL && entry->block_id == block_id) cache_drop(sv, entry);
+	pthread_mutex_unlock(&cache_l);
+}
+
+/* caches bdata, a block of the file of meta, unless the file has left the
+ * cache or was cached again since block_id was handed out. returns 1 if it
+ * was cached. */
+static int cache_add_block(struct server *sv, const struct file_data *meta,
+			   unsigned long block_id, struct file_data *bdata) {
+	fentry *entry;
+	int added = 0;
+
+	pthread_mutex_lock(&cache_l);
+	entry = cache_lookup(sv, meta->file_name);
+	if (entry != NULL && entry->block_id == block_id &&
+	    cache_lookup(sv, bdata->file_name) == NULL &&
+	    cache_evict(sv, get_charge(sv, bdata)) == 1) {
+		entry = table_insert(sv, bdata);
+		entry->is_block = 1;
+		sv->cache->stats.block_inserts++;
+		added = 1;
 	}
-	if(sv->cache->ftable[hash] != NULL && strcmp(sv->cache->ftable[hash]->fname, fname) == 0) {
-		return sv->cache->ftable[hash];
+	pthread_mutex_unlock(&cache_l);
+	return added;
+}
+
+/* the file of meta, cached under block_id, was streamed whole into data.
+ * its entry gets the checksum, so that hits on it send Content-Csum. the
+ * entry is given a new copy, requests may be sending the old one. */
+static void cache_meta_ready(struct server *sv, const struct file_data *meta,
+			     unsigned long block_id,
+			     const struct file_data *data) {
+	struct file_data *ready;
+	fentry *entry;
+
+	pthread_mutex_lock(&cache_l);
+	entry = cache_lookup(sv, meta->file_name);
+	if (entry != NULL && entry->block_id == block_id &&
+	    !entry->fdata->file_ready) {
+		ready = file_data_copy(sv, entry->fdata);
+		ready->file_csum = data->file_csum;
+		ready->file_processed = data->file_processed;
+		ready->file_ready = 1;
+		file_data_put(entry->fdata);
+		entry->fdata = ready;
+	}
+	pthread_mutex_unlock(&cache_l);
+}
+
+/* where cache_send_range gets the blocks of a file from */
+struct block_send {
+	struct server *sv;
+	const struct file_data *meta;
+	unsigned long block_id;
+	long budget;	/* left for caching blocks read from the file */
+	int fd;		/* the file, once a block was read from it */
+	int failed;	/* the file changed, and the response was aborted */
+};
+
+/* sends len bytes of the file from off, from the blocks they are in. the
+ * blocks that aren't cached are read from the file and cached, but not
+ * more than half of the cache is filled by one request. */
+static void cache_send_range(struct request *rq, void *arg, long off,
+			     long len) {
+	struct block_send *bs = arg;
+	struct server *sv = bs->sv;
+	const struct file_data *meta = bs->meta;
+	char key[MAXLINE + 64];
+	struct file_data *bdata;
+	fentry *entry;
+	char *unpacked;
+	long skip, n;
+	int i, size;
+
+	if (bs->failed) return;
+	for (i = off / sv->cache->block_size; len > 0; i++) {
+		block_key(key, sizeof(key), meta, bs->block_id, i);
+		size = block_size(sv, meta, i);
+		/* only the first block may start before off */
+		skip = off - (long)i * sv->cache->block_size;
+		n = size - skip < len ? size - skip : len;
+
+		pthread_mutex_lock(&cache_l);
+		entry = cache_lookup(sv, key);
+		if (entry != NULL) {
+			bdata = entry->fdata;
+			file_data_get(bdata);
+			update(sv, entry);
+			sv->cache->stats.block_hits++;
+			sv->cache->stats.hit_bytes += n;
+			pthread_mutex_unlock(&cache_l);
+
+			if (bdata->file_zsize > 0) {
+				unpacked = arena_alloc(sv->arena, size);
+				lz_decompress(bdata->file_buf,
+					      bdata->file_zsize, unpacked,
+					      size);
+				request_send_body(rq, unpacked + skip, n);
+				arena_free(sv->arena, unpacked, size);
+			} else {
+				request_send_body(rq, bdata->file_buf + skip,
+						  n);
+			}
+			file_data_put(bdata);
+		} else {
+			sv->cache->stats.block_misses++;
+			sv->cache->stats.miss_bytes += n;
+			pthread_mutex_unlock(&cache_l);
+
+			bdata = block_read(sv, meta, bs->block_id, i,
+					   &bs->fd);
+			if (bdata == NULL) {
+				/* the header promised the whole range, don't
+				 * let the client take a short body for it */
+				cache_drop_blocks(sv, meta, bs->block_id);
+				request_abort(rq);
+				bs->failed = 1;
+				return;
+			}
+			request_send_body(rq, bdata->file_buf + skip, n);
+			if (size <= bs->budget &&
+			    cache_add_block(sv, meta, bs->block_id, bdata))
+				bs->budget -= size;
+			file_data_put(bdata);
+		}
+		off += n;
+		len -= n;
 	}
-	return NULL;
 }
 
-int cache_evict(struct server *sv, int reqsize ) {
+/* sends the body of a file that is cached in blocks, or the ranges of it
+ * that request_send_header settled on */
+static void cache_send_blocks(struct server *sv, struct request *rq,
+			      const struct file_data *meta,
+			      unsigned long block_id) {
+	struct block_send bs;
+
+	bs.sv = sv;
+	bs.meta = meta;
+	bs.block_id = block_id;
+	bs.budget = sv->cache->max_cache_size / 2;
+	bs.fd = -1;
+	bs.failed = 0;
+	request_send_ranges(rq, cache_send_range, &bs);
+	if (bs.fd >= 0) SYS(close(bs.fd));
+}
+
+int cache_evict(struct server *sv, long reqsize ) {
 	if (reqsize > sv->cache->max_cache_size) return 0;
-	if (sv->max_cache_size - sv->cache->size > reqsize) return 1;
-	if (sv->cache->lru_queue->head == NULL) return 0;
+	if (sv->cache->max_cache_size - sv->cache->size >= reqsize) return 1;
+	if (sv->cache->evict_heap->size == 0) return 0;
 	return table_delete(sv, reqsize);
 }
 
-int table_delete(struct server *sv, int reqsize) {
-	queue *ll = sv->cache->lru_queue;
+/* takes the entry with the lowest priority out of the cache and returns it,
+ * or returns NULL if it was queued to be compressed instead. entries that are being sent
+ * are evicted too, the requests sending them hold their own references to
+ * the bodies. */
+static fentry *cache_evict_next(struct server *sv) {
+	cache *cache = sv->cache;
+	heap *h = cache->evict_heap;
+	fentry *item = h->items[0];
+
+	heap_remove(h, item);
+	if (cache->compress && item->zstate == ZSTATE_RAW &&
+	    cache_queue_demote(sv, item))
+		return NULL;
+	if (cache->policy != CACHE_POLICY_LRU) {
+		cache->inflation = item->priority;
+	}
+	table_remove(sv, item);
+	cache->size -= item->charge;
+	cache->stats.evictions++;
+	cache_prefetch_done(cache, item, 0);
+	/* blocks are found through their file's entry only. the reclaimer
+	 * writes it out once it has let go of cache_l, see entry_retire. */
+	if (sv->spill != NULL && !item->is_block &&
+	    item->fdata->file_blocks == 0) {
+		item->spill = 1;
+		item->generation = cache->generation;
+	}
+	return item;
+}
+
+int table_delete(struct server *sv, long reqsize) {
 	cache *cache = sv->cache; // to make < 80 characters lol
-	node *curr = ll->head;
-
-	while (curr != NULL && (sv->max_cache_size - cache->size) < reqsize) {
-		fentry *item = cache->ftable[curr->fkey];
-		if (item != NULL && item->in_use == 0) {
-			cache->size -= item->fdata->file_size;
-			free(item->fdata);	
-			free(item->fname);
-			free(item);
-			cache->ftable[curr->fkey] = NULL;
-			pop_any(ll, curr->fkey);
+	heap *h = cache->evict_heap;
+	fentry *item;
+
+	while (h->size > 0 && (cache->max_cache_size - cache->size) < reqsize) {
+		item = cache_evict_next(sv);
+		if (item != NULL) {
+			cache->stats.inline_evictions++;
+			cache_release(sv, item);
 		}
-		curr = curr->next;
 	}
-	if ((sv->max_cache_size - cache->size) >= reqsize) {
+	if ((cache->max_cache_size - cache->size) >= reqsize) {
 		return 1;
 	} else { 
 		return 0;
@@ -211,11 +1227,119 @@ int table_delete(struct server *sv, int reqsize) {
 fentry *cache_insert(struct server *sv, struct file_data *fdata) {
 	fentry *entry = cache_lookup(sv, fdata->file_name);
 	if (entry != NULL) return entry;
-	if (cache_evict(sv, fdata->file_size) == 1) 
+	if (cache_evict(sv, get_charge(sv, fdata)) == 1) 
 		return table_insert(sv, fdata);
 	return entry;
 }
 
+/* called by the pressure thread when the budget changes. the reclaimer
+ * evicts whatever no longer fits, and when the budget shrank, returns the
+ * memory that frees to the kernel. */
+static void cache_set_budget(void *arg, long budget) {
+	struct server *sv = arg;
+	cache *cache = sv->cache;
+
+	pthread_mutex_lock(&cache_l);
+	if (budget < cache->max_cache_size && sv->arena != NULL)
+		cache->trim = 1;
+	cache->max_cache_size = budget;
+	cache_set_watermarks(cache);
+	if (cache->trim ||
+	    cache->max_cache_size - cache->size < cache->reclaim_low)
+		pthread_cond_signal(&cache->reclaim_cond);
+	pthread_mutex_unlock(&cache_l);
+}
+
+/* frees an entry that left the cache, without cache_l held. an evicted
+ * entry is written to the spill file first. if a file changed since it was
+ * evicted, the watcher may have cleared the spill file of it before it was
+ * written, so it is taken out again. */
+static void entry_retire(struct server *sv, fentry *entry) {
+	int changed;
+
+	if (entry->spill) {
+		cache_spill(sv, entry);
+		pthread_mutex_lock(&cache_l);
+		changed = entry->generation != sv->cache->generation;
+		pthread_mutex_unlock(&cache_l);
+		if (changed) spill_remove(sv->spill, entry->fname, 0);
+	}
+	entry_free(entry);
+}
+
+/* keeps reclaim_low to reclaim_high bytes of the cache free, so that inserts
+ * rarely have to evict, compresses what eviction queued, and frees what was
+ * evicted. it evicts a batch at a time and spills and frees the batch without
+ * cache_l, so requests get the lock in between. it compresses without
+ * cache_l too, and takes the lock again only to swap the results in. without
+ * reclaim it does not evict itself. */
+static void *reclaim_main(void *arg) {
+	struct server *sv = arg;
+	cache *cache = sv->cache;
+	struct file_data *packing[PACK_QUEUE], *packed[PACK_QUEUE];
+	fentry *list, *item;
+	int i, nr, trim;
+
+	pthread_mutex_lock(&cache_l);
+	while (1) {
+		if (cache->reclaim && !cache->reclaim_stop &&
+		    cache->max_cache_size - cache->size < cache->reclaim_low)
+			cache->reclaiming = 1;
+		if (cache->released == NULL && cache->nr_packing == 0 &&
+		    !cache->reclaiming && !cache->trim) {
+			if (cache->reclaim_stop) break;
+			pthread_cond_wait(&cache->reclaim_cond, &cache_l);
+			continue;
+		}
+		list = cache->released;
+		cache->released = NULL;
+		nr = cache->nr_packing;
+		memcpy(packing, cache->packing, nr * sizeof(packing[0]));
+		cache->nr_packing = 0;
+		for (i = 0; cache->reclaiming && i < RECLAIM_BATCH; i++) {
+			if (cache->evict_heap->size == 0 ||
+			    cache->max_cache_size - cache->size >=
+			    cache->reclaim_high) {
+				cache->reclaiming = 0;
+				break;
+			}
+			item = cache_evict_next(sv);
+			if (item != NULL) {
+				item->next = list;
+				list = item;
+				cache->stats.reclaimed++;
+			}
+		}
+		if (i > 0) cache->stats.reclaim_batches++;
+		/* once what no longer fits is evicted */
+		trim = cache->trim && !cache->reclaiming;
+		if (trim) cache->trim = 0;
+		pthread_mutex_unlock(&cache_l);
+
+		while (list != NULL) {
+			item = list;
+			list = list->next;
+			entry_retire(sv, item);
+		}
+		if (trim) arena_trim(sv->arena);
+		for (i = 0; i < nr; i++)
+			packed[i] = cache_pack(sv, packing[i]);
+		pthread_mutex_lock(&cache_l);
+		for (i = 0; i < nr; i++)
+			cache_demote(sv, packing[i], packed[i]);
+		if (nr > 0) {
+			/* the last references to the raw bodies that were
+			 * swapped out, freed without cache_l */
+			pthread_mutex_unlock(&cache_l);
+			for (i = 0; i < nr; i++)
+				file_data_put(packing[i]);
+			pthread_mutex_lock(&cache_l);
+		}
+	}
+	pthread_mutex_unlock(&cache_l);
+	return NULL;
+}
+
 fentry *create_entry(struct server *sv, struct file_data *fdata) {
 	fentry *entry = (fentry*)malloc(sizeof(struct fentry));
 
@@ -224,13 +1348,30 @@ fentry *create_entry(struct server *sv, struct file_data *fdata) {
 	entry->fname[strlen(fdata->file_name)] = '\0';
 
 	entry->fdata = fdata;
-	entry->in_use = 0;
+	file_data_get(fdata);
+	entry->charge = get_charge(sv, fdata);
+	entry->freq = 1;
+	entry->priority = get_priority(sv->cache, entry);
+	entry->heap_idx = -1;
+	entry->zstate = ZSTATE_RAW;
+	entry->zhits = 0;
+	entry->prefetched = 0;
+	entry->is_block = 0;
+	entry->block_id = 0;
+	entry->spill = 0;
+	entry->generation = 0;
+	entry->next = NULL;
 	
 	return entry;
 }
 
 fentry* table_insert(struct server *sv, struct file_data *fdata) {
+	if (sv->cache->old_ftable != NULL)
+		table_migrate(sv, TABLE_MIGRATE);
+	if (2 * (sv->cache->nr_entries + 1) > sv->cache->table_size)
+		table_grow(sv);
 	long hash = get_hash(sv, fdata->file_name);
+	long home = hash;
 	
 	// avoiding collisions and repeated words
 	while(sv->cache->ftable != NULL && sv->cache->ftable[hash] != NULL && strcmp(sv->cache->ftable[hash]->fname, fdata->file_name) != 0) {
@@ -239,120 +1380,763 @@ fentry* table_insert(struct server *sv, struct file_data *fdata) {
 	}
 	
 	fentry *entry = create_entry(sv, fdata);
+	entry->home = home;
 
 	sv->cache->ftable[hash] = entry;
-	sv->cache->size += fdata->file_size;
-	insert_front(sv->cache->lru_queue, hash);
+	sv->cache->nr_entries++;
+	sv->cache->size += entry->charge;
+	sv->cache->stats.inserts++;
+	heap_push(sv->cache->evict_heap, entry);
+	if (sv->cache->max_cache_size - sv->cache->size <
+	    sv->cache->reclaim_low)
+		pthread_cond_signal(&sv->cache->reclaim_cond);
 	return sv->cache->ftable[hash];
 }
 
+/* frees the entries still cached, the tables and the heap, and then the
+ * arena the bodies came from. the threads that use the cache are done. */
+static void cache_destroy(struct server *sv) {
+	cache *cache = sv->cache;
+	long i;
+
+	for (i = 0; i < cache->table_size; i++)
+		if (cache->ftable[i] != NULL) entry_free(cache->ftable[i]);
+	arena_unmap_pages(cache->ftable, cache->table_size * sizeof(fentry *),
+			  sv->hugepages);
+	if (cache->old_ftable != NULL) {
+		for (i = 0; i < cache->old_table_size; i++)
+			if (cache->old_ftable[i] != NULL)
+				entry_free(cache->old_ftable[i]);
+		arena_unmap_pages(cache->old_ftable,
+				  cache->old_table_size * sizeof(fentry *),
+				  sv->hugepages);
+	}
+	free(cache->evict_heap->items);
+	free(cache->evict_heap);
+	pthread_cond_destroy(&cache->reclaim_cond);
+	free(cache);
+	sv->cache = NULL;
+	if (sv->arena != NULL) arena_destroy(sv->arena);
+	sv->arena = NULL;
+}
+
+static void
+cache_print_stats(struct server *sv)
+{
+	struct cache_stats *st = &sv->cache->stats;
+	unsigned long requests = st->hits + st->misses;
+	unsigned long long bytes = st->hit_bytes + st->miss_bytes;
+	struct arena_stats as;
+
+	printf("cache: %lu hits, %lu misses, %lu inserts, %lu evictions\n",
+	       st->hits, st->misses, st->inserts, st->evictions);
+	printf("cache: hit ratio %.4f, byte hit ratio %.4f\n",
+	       requests ? (double)st->hits / requests : 0.0,
+	       bytes ? (double)st->hit_bytes / bytes : 0.0);
+	printf("cache: %ld bytes used of %ld, %ld entries in %ld slots\n",
+	       sv->cache->size, sv->cache->max_cache_size,
+	       sv->cache->nr_entries, sv->cache->table_size);
+	if (st->not_modified > 0)
+		printf("cache: %lu hits answered with 304 Not Modified\n",
+		       st->not_modified);
+	if (st->disk_ranges > 0)
+		printf("cache: %lu misses for ranges sent from the disk\n",
+		       st->disk_ranges);
+	if (st->encoded > 0)
+		printf("cache: %lu hits sent a precompressed copy\n",
+		       st->encoded);
+	if (st->streamed > 0)
+		printf("cache: %lu misses streamed rather than cached\n",
+		       st->streamed);
+	if (sv->cache->compress)
+		printf("cache: %lu compressed, %lu decompressed, %lu hits on "
+		       "compressed entries, %lu incompressible\n",
+		       st->demotions, st->promotions, st->packed_hits,
+		       st->incompressible);
+	if (sv->warmup != NULL) {
+		struct warmup_stats ws;
+
+		warmup_get_stats(sv->warmup, &ws);
+		printf("warmup: %lu of %lu files read (%llu bytes) in %.1fs, "
+		       "%lu cached%s\n", ws.loaded, ws.listed, ws.bytes,
+		       ws.seconds, st->warmed, ws.done ? "" : ", stopped early");
+	}
+	if (sv->prefetch != NULL) {
+		struct prefetch_stats ps;
+
+		prefetch_get_stats(sv->prefetch, &ps);
+		printf("prefetch: %lu requests seen, %lu files predicted, %lu "
+		       "dropped, %lu read (%llu bytes)\n", ps.accesses,
+		       ps.predictions, ps.dropped, ps.loads, ps.bytes);
+		printf("prefetch: %lu cached, hit ratio %.4f, waste ratio %.4f, "
+		       "%ld bytes not used yet\n", st->prefetched,
+		       st->prefetched ?
+		       (double)st->prefetch_hits / st->prefetched : 0.0,
+		       st->prefetched ?
+		       (double)st->prefetch_waste / st->prefetched : 0.0,
+		       sv->cache->prefetch_bytes);
+	}
+	if (sv->pressure != NULL) {
+		struct pressure_stats ps;
+
+		pressure_get_stats(sv->pressure, &ps);
+		printf("budget: %ld bytes of at most %ld, lowest %ld, shrunk %lu "
+		       "and grown %lu times in %lu readings (cgroup %s, psi "
+		       "%s)\n", ps.budget, sv->max_cache_size, ps.lowest,
+		       ps.shrinks, ps.grows, ps.samples,
+		       ps.cgroup ? "yes" : "no", ps.psi ? "yes" : "no");
+	}
+	if (sv->cache->reclaim)
+		printf("reclaim: %lu entries evicted in the background in %lu "
+		       "batches, %lu evicted by inserts\n", st->reclaimed,
+		       st->reclaim_batches, st->inline_evictions);
+	if (st->block_hits + st->block_misses + st->block_inserts > 0)
+		printf("blocks: %lu sent from memory, %lu read from disk, "
+		       "%lu cached\n", st->block_hits, st->block_misses,
+		       st->block_inserts);
+	if (sv->negative != NULL) {
+		struct negcache_stats ns;
+
+		negcache_get_stats(sv->negative, &ns);
+		printf("negative: %lu hits, %lu inserts, %lu expired, "
+		       "%lu evicted, %lu invalidated\n", ns.hits, ns.inserts,
+		       ns.expired, ns.evicted, ns.invalidated);
+	}
+	if (st->invalidations > 0)
+		printf("cache: %lu entries dropped because their files changed\n",
+		       st->invalidations);
+	if (sv->spill != NULL) {
+		struct spill_stats ss;
+
+		spill_get_stats(sv->spill, &ss);
+		printf("spill: %lu stores, %lu hits, %lu misses, %lu overwritten, "
+		       "%lu stale, %lld bytes live\n", ss.stores, ss.hits,
+		       ss.misses, ss.overwritten, ss.stale, ss.bytes);
+	}
+	if (sv->tlb_stats && st->tlb_hits == 0)
+		printf("cache: hit path dTLB misses not available\n");
+	else if (sv->tlb_stats)
+		printf("cache: hit path dTLB misses %llu, %.1f per hit\n",
+		       st->hit_tlb_misses,
+		       (double)st->hit_tlb_misses / st->tlb_hits);
+	if (sv->arena == NULL) return;
+	arena_get_stats(sv->arena, &as);
+	printf("arena: %zu bytes mapped, %zu allocated, %zu requested, "
+	       "%lu slabs (%lu hugetlb), %lu large blocks\n", as.mapped,
+	       as.allocated, as.requested, as.nr_slabs, as.nr_hugetlb,
+	       as.nr_large);
+}
+
+static void
+log_print_stats(struct server *sv)
+{
+	struct accesslog_stats st;
+
+	accesslog_get_stats(sv->log, &st);
+	printf("log: %lu requests logged in %lu writes, %lu dropped\n",
+	       st.written, st.batches, st.dropped);
+}
+
+/* prints the estimated miss ratio curve, at every doubling of the cache size
+ * up to where only first requests miss */
+static void
+mrc_print_curve(struct server *sv)
+{
+	struct mrc_stats ms;
+	long long size;
+
+	mrc_get_stats(sv->mrc, &ms);
+	printf("mrc: %lu requests, %lu sampled, sampling rate %.4f\n",
+	       ms.requests, ms.sampled, ms.rate);
+	printf("mrc: cache size, estimated LRU miss ratio\n");
+	for (size = 64 * 1024; ; size *= 2) {
+		printf("mrc: %lld, %.4f\n", size, mrc_miss_ratio(sv->mrc, size));
+		if (size >= ms.max_distance)
+			break;
+	}
+	if (sv->max_cache_size > 0)
+		printf("mrc: %ld, %.4f (max_cache_size)\n", sv->max_cache_size,
+		       mrc_miss_ratio(sv->mrc, sv->max_cache_size));
+}
+
+/* dTLB read misses of the calling thread so far, or -1 if the counter is not
+ * available (no PMU access, e.g. perf_event_paranoid or a VM) */
+static __thread int tlb_fd = -2;
+
+static long long
+tlb_misses(void)
+{
+	long long count;
+
+	if (tlb_fd == -2) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_DTLB |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		tlb_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (tlb_fd < 0) {
+			/* user space only needs fewer privileges */
+			attr.exclude_kernel = 1;
+			tlb_fd = syscall(SYS_perf_event_open, &attr, 0, -1,
+					 -1, 0);
+		}
+	}
+	if (tlb_fd < 0 || read(tlb_fd, &count, sizeof(count)) != sizeof(count))
+		return -1;
+	return count;
+}
+
+/* closes the counter of the calling thread, as it exits */
+static void
+tlb_close(void)
+{
+	if (tlb_fd >= 0)
+		SYS(close(tlb_fd));
+	tlb_fd = -2;
+}
 
 /* static functions */
 
-/* initialize file data */
+/* identifies the client on connfd by its address, for the prefetcher */
+static unsigned long
+client_id(int connfd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	unsigned long id = 5381;
+	unsigned char *p;
+	size_t n;
+
+	if (getpeername(connfd, (struct sockaddr *)&addr, &len) < 0)
+		return 0;
+	if (addr.ss_family == AF_INET) {
+		p = (unsigned char *)&((struct sockaddr_in *)&addr)->sin_addr;
+		n = sizeof(struct in_addr);
+	} else if (addr.ss_family == AF_INET6) {
+		p = (unsigned char *)&((struct sockaddr_in6 *)&addr)->sin6_addr;
+		n = sizeof(struct in6_addr);
+	} else {
+		return 0;
+	}
+	while (n-- > 0)
+		id = ((id << 5) + id) + *p++;
+	return id;
+}
+
+/* file data let go of by a thread are kept for its next requests, up to
+ * FILE_DATA_POOL of them, with their file name buffers, so that a request
+ * for a cached file allocates nothing */
+#define FILE_DATA_POOL 16
+
+struct file_data_pool {
+	int nr;
+	struct file_data *free[FILE_DATA_POOL];
+};
+
+static pthread_key_t file_data_key;
+static pthread_once_t file_data_once = PTHREAD_ONCE_INIT;
+
+static void
+file_data_pool_destroy(void *arg)
+{
+	struct file_data_pool *pool = arg;
+
+	while (pool->nr > 0) {
+		struct file_data *data = pool->free[--pool->nr];
+
+		free(data->file_name);
+		free(data);
+	}
+	free(pool);
+}
+
+static void
+file_data_pool_key_init(void)
+{
+	pthread_key_create(&file_data_key, file_data_pool_destroy);
+}
+
+/* the calling thread's pool */
+static struct file_data_pool *
+file_data_pool(void)
+{
+	struct file_data_pool *pool;
+
+	pthread_once(&file_data_once, file_data_pool_key_init);
+	if ((pool = pthread_getspecific(file_data_key)) == NULL) {
+		pool = Malloc(sizeof(struct file_data_pool));
+		pool->nr = 0;
+		pthread_setspecific(file_data_key, pool);
+	}
+	return pool;
+}
+
+/* initialize file data. file_name is left to request_allocname, and may
+ * hold the name of the file the data was last used for. */
 static struct file_data *
-file_data_init(void)
+file_data_init(struct server *sv)
 {
+	struct file_data_pool *pool = file_data_pool();
 	struct file_data *data;
 
-	data = Malloc(sizeof(struct file_data));
-	data->file_name = NULL;
+	if (pool->nr > 0) {
+		data = pool->free[--pool->nr];
+	} else {
+		data = Malloc(sizeof(struct file_data));
+		data->file_name = NULL;
+		data->file_name_max = 0;
+	}
 	data->file_buf = NULL;
+	data->file_storage = sv->storage;
+	data->file_arena = sv->arena;
+	data->file_mlock = sv->storage_mlock;
+	data->file_zsize = 0;
 	data->file_size = 0;
+	data->file_mtime = 0;
+	data->file_mtime_ns = 0;
+	data->file_ino = 0;
+	data->file_encodings = 0;
+	data->file_blocks = 0;
+	data->file_ready = 0;
+	data->file_refs = 1;
 	return data;
 }
 
+/* new file data for the same file as data, without the body */
+static struct file_data *
+file_data_copy(struct server *sv, const struct file_data *data)
+{
+	struct file_data *copy = file_data_init(sv);
+
+	strcpy(request_allocname(copy, strlen(data->file_name) + 1),
+	       data->file_name);
+	copy->file_storage = data->file_storage;
+	copy->file_arena = data->file_arena;
+	copy->file_mlock = data->file_mlock;
+	copy->file_size = data->file_size;
+	copy->file_mtime = data->file_mtime;
+	copy->file_mtime_ns = data->file_mtime_ns;
+	copy->file_ino = data->file_ino;
+	copy->file_encodings = data->file_encodings;
+	copy->file_blocks = data->file_blocks;
+	copy->file_csum = data->file_csum;
+	copy->file_type = data->file_type;
+	copy->file_processed = data->file_processed;
+	copy->file_ready = data->file_ready;
+	return copy;
+}
+
 /* free all file data */
 static void
 file_data_free(struct file_data *data)
 {
-	free(data->file_name);
-	free(data->file_buf);
-	free(data);
+	struct file_data_pool *pool = file_data_pool();
+
+	request_freebuf(data);
+	if (pool->nr < FILE_DATA_POOL) {
+		pool->free[pool->nr++] = data;
+	} else {
+		free(data->file_name);
+		free(data);
+	}
+}
+
+/* file data is shared by the cache and the requests sending it, which each
+ * hold a reference. the last one to let go frees it, so an entry can leave
+ * the cache at any time, even while it is being sent. */
+static void
+file_data_get(struct file_data *data)
+{
+	__atomic_add_fetch(&data->file_refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+file_data_put(struct file_data *data)
+{
+	if (__atomic_sub_fetch(&data->file_refs, 1, __ATOMIC_ACQ_REL) == 0)
+		file_data_free(data);
+}
+
+/* if the client takes a precompressed copy of the file, and there is one,
+ * sends that instead. which copies there are is kept with the cached file,
+ * or else known from the copies that are cached, so that the disk is only
+ * searched for them when neither is. what the search finds is kept in rq,
+ * so a miss reads the file without looking again. returns 1 if it set
+ * *generation to that of the cache before the search, see
+ * do_server_request. */
+static int
+cache_negotiate(struct server *sv, struct request *rq, struct file_data *data,
+		unsigned long *generation)
+{
+	char name[MAXLINE];
+	fentry *entry;
+	int have = -1, enc = 0;
+
+	if (request_pick_encoding(rq, FILE_ENC_ALL) == 0)
+		return 0;
+	if (sv->max_cache_size > 0) {
+		pthread_mutex_lock(&cache_l);
+		*generation = sv->cache->generation;
+		if ((entry = cache_lookup(sv, data->file_name)) != NULL) {
+			have = entry->fdata->file_encodings;
+		} else {
+			for (enc = 1; enc <= FILE_ENC_ALL; enc <<= 1) {
+				if (request_sidecar_name(data->file_name, enc,
+							 name, sizeof(name)) &&
+				    cache_lookup(sv, name) != NULL)
+					have = (have < 0 ? 0 : have) | enc;
+			}
+		}
+		if (have >= 0)
+			enc = request_pick_encoding(rq, have);
+		pthread_mutex_unlock(&cache_l);
+	}
+	if (have < 0)
+		enc = request_pick_encoding(rq, request_stat_encodings(rq));
+	if (enc != 0)
+		request_set_encoding(rq, enc);
+	return sv->max_cache_size > 0;
+}
+
+/* a miss that may be streamed, see stream_file and stream_fill */
+struct stream_miss {
+	struct server *sv;
+	unsigned long generation;	/* of the cache at the lookup */
+	struct file_data *meta;	/* the entry of a file cached in blocks that
+				 * is streamed, or NULL */
+	unsigned long block_id;	/* it was cached under */
+	struct file_data *block; /* the block being filled, or NULL */
+	long budget;		/* left for caching its blocks */
+};
+
+static void stream_miss_init(struct stream_miss *sm, struct server *sv,
+			     unsigned long generation) {
+	sm->sv = sv;
+	sm->generation = generation;
+	sm->meta = NULL;
+	sm->block_id = 0;
+	sm->block = NULL;
+	sm->budget = sv->cache != NULL ? sv->cache->max_cache_size / 2 : 0;
+}
+
+/* returns 1 if the file of data should be streamed, for request_readfile:
+ * it has at least stream_size bytes, and reading it whole would not get it
+ * cached. a file cached in blocks is always streamed, never read whole, and
+ * its entry is cached here for stream_fill to fill in. */
+static int
+stream_file(void *arg, struct file_data *data)
+{
+	struct stream_miss *sm = arg;
+	struct server *sv = sm->sv;
+	fentry *entry;
+	int stream;
+
+	if (sv->cache != NULL && cache_blocked(sv->cache, data->file_size)) {
+		pthread_mutex_lock(&cache_l);
+		entry = sm->generation == sv->cache->generation ?
+			cache_insert_meta(sv, data) : NULL;
+		if (entry != NULL) {
+			sm->meta = entry->fdata;
+			file_data_get(sm->meta);
+			sm->block_id = entry->block_id;
+		}
+		pthread_mutex_unlock(&cache_l);
+		return 1;
+	}
+	if (sv->stream_size <= 0 || data->file_size < sv->stream_size)
+		return 0;
+	if (sv->cache == NULL)
+		return 1;
+	pthread_mutex_lock(&cache_l);
+	/* it is only cached if no file changed since the lookup, no other
+	 * request cached it meanwhile, and room can be made for it. the room
+	 * is made now, cache_insert would evict the same entries. */
+	stream = sm->generation != sv->cache->generation ||
+		cache_lookup(sv, data->file_name) != NULL ||
+		cache_evict(sv, get_charge(sv, data)) != 1;
+	pthread_mutex_unlock(&cache_l);
+	return stream;
+}
+
+/* caches the blocks of the file that stream_file cached the entry of from
+ * the chunks of it as they are sent, for request_readfile. a block is
+ * cached once it is full, so memory for one block is held at a time, and
+ * no more than half the cache is filled, as in cache_send_range. */
+static void
+stream_fill(void *arg, const char *buf, long off, long len)
+{
+	struct stream_miss *sm = arg;
+	struct server *sv = sm->sv;
+	long skip, n;
+	int i, size;
+
+	if (sm->meta == NULL)
+		return;
+	while (len > 0) {
+		i = off / sv->cache->block_size;
+		skip = off - (long)i * sv->cache->block_size;
+		size = block_size(sv, sm->meta, i);
+		n = size - skip < len ? size - skip : len;
+		/* a block is filled from its first byte on */
+		if (sm->block == NULL && skip == 0 && size <= sm->budget)
+			sm->block = block_alloc(sv, sm->meta, sm->block_id, i);
+		if (sm->block != NULL) {
+			memcpy(sm->block->file_buf + skip, buf, n);
+			if (skip + n == size) {
+				sm->block->file_ready = 1;
+				if (cache_add_block(sv, sm->meta, sm->block_id,
+						    sm->block))
+					sm->budget -= size;
+				file_data_put(sm->block);
+				sm->block = NULL;
+			}
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/* done streaming the miss for data */
+static void stream_miss_done(struct stream_miss *sm, struct file_data *data) {
+	if (sm->block != NULL)
+		file_data_put(sm->block);	/* the file got shorter */
+	if (sm->meta == NULL)
+		return;
+	if (data->file_ready)
+		cache_meta_ready(sm->sv, sm->meta, sm->block_id, data);
+	file_data_put(sm->meta);
 }
 
 static void
 do_server_request(struct server *sv, int connfd)
 {
-	int ret;
+	int ret, negotiated;
 	struct request *rq;
 	struct file_data *data;
+	unsigned long generation = 0;
+	struct stream_miss sm;
 
-	data = file_data_init();
+	data = file_data_init(sv);
 
 	/* fill data->file_name with name of the file being requested */
 	rq = request_init(connfd, data);
 	if (!rq) {
-		file_data_free(data);
+		file_data_put(data);
 		return;
 	}
 
+	if (sv->prefetch != NULL)
+		prefetch_access(sv->prefetch, client_id(connfd),
+				data->file_name);
+
+	if (sv->negative != NULL) {
+		char buf[MAXBUF];
+		int size = negcache_lookup(sv->negative, data->file_name, buf,
+					   sizeof(buf));
+
+		if (size > 0) {
+			/* known to be missing, send the same error again */
+			request_set_cache(rq, "negative");
+			request_send_response(rq, buf, size);
+			request_destroy(rq);
+			file_data_put(data);
+			return;
+		}
+	}
+
+	negotiated = cache_negotiate(sv, rq, data, &generation);
+
 	if (sv->max_cache_size > 0) {
+		long long tlb_start = sv->tlb_stats ? tlb_misses() : -1;
+
 		pthread_mutex_lock(&cache_l);
+		/* a miss may read the file with what negotiating found on the
+		 * disk, so a change since then has to count too */
+		if (!negotiated)
+			generation = sv->cache->generation;
 		fentry *entry = cache_lookup(sv, data->file_name);
 		if (entry != NULL) {
-			data = entry->fdata;
-			request_set_data(rq, data);
-			if (entry != NULL) entry->in_use++;
-			update(sv, get_hash(sv, data->file_name));
+			struct file_data unpacked, *cached = entry->fdata;
+			unsigned long block_id = entry->block_id;
+			int packed;
+
+			/* send our own reference to the cached data, the entry
+			 * may be evicted meanwhile */
+			file_data_get(cached);
+			update(sv, entry);
+			cache_prefetch_done(sv->cache, entry, 1);
+			sv->cache->stats.hits++;
+			/* blocks count for themselves */
+			if (cached->file_blocks == 0)
+				sv->cache->stats.hit_bytes += cached->file_size;
+			packed = cached->file_zsize > 0;
+			if (packed) sv->cache->stats.packed_hits++;
+			if (request_get_encoding(rq) != 0)
+				sv->cache->stats.encoded++;
 			pthread_mutex_unlock(&cache_l);
-
-			request_sendfile(rq);
+			file_data_put(data);
+			data = cached;
+			request_set_data(rq, data);
+			request_set_cache(rq, "hit");
+			if (sv->mrc != NULL)
+				mrc_access(sv->mrc, data->file_name,
+					   data->file_size);
+
+			/* a 304 needs no body to decompress */
+			if (packed && request_not_modified(rq))
+				packed = 0;
+			if (packed) {
+				/* the compressed body can't change while we
+				 * hold it, decompress a private copy */
+				unpacked = *data;
+				unpacked.file_buf = arena_alloc(sv->arena,
+								data->file_size);
+				unpacked.file_zsize = 0;
+				ret = lz_decompress(data->file_buf,
+						    data->file_zsize,
+						    unpacked.file_buf,
+						    data->file_size);
+				assert(ret == data->file_size);
+				request_set_data(rq, &unpacked);
+			}
+			if (data->file_blocks > 0) {
+				if (request_send_header(rq))
+					cache_send_blocks(sv, rq, data,
+							  block_id);
+			} else {
+				request_sendfile(rq);
+			}
+			long long tlb_end = tlb_start >= 0 ? tlb_misses() : -1;
 
 			pthread_mutex_lock(&cache_l);
-			if (entry != NULL ) entry->in_use--;
+			if (packed) cache_promote(sv, data, unpacked.file_buf);
+			/* not sent can also be a 416, or a client that left */
+			if (request_sent_status(rq) == 304)
+				sv->cache->stats.not_modified++;
+			if (tlb_end >= 0) {
+				sv->cache->stats.hit_tlb_misses += tlb_end - tlb_start;
+				sv->cache->stats.tlb_hits++;
+			}
 			pthread_mutex_unlock(&cache_l);
 
 			goto out;
 		} else if (entry == NULL) {
 			pthread_mutex_unlock(&cache_l);
 
-			ret = request_readfile(rq);
-			if (ret == 0)	goto out; /* couldn't read file */
+			/* a range of a file that isn't cached is sent from
+			 * the disk, without reading in the rest of the file */
+			if (request_has_range(rq)) {
+				request_set_cache(rq, "disk");
+				ret = request_sendfile_disk(rq);
+				if (ret == 0 && sv->negative != NULL)
+					cache_negative(sv, rq, data->file_name,
+						       generation);
+				pthread_mutex_lock(&cache_l);
+				if (ret != 0) {
+					sv->cache->stats.misses++;
+					sv->cache->stats.disk_ranges++;
+				}
+				pthread_mutex_unlock(&cache_l);
+				goto out;
+			}
 
+			/* try the spill file before going to the disk. a file
+			 * the cache can't take is sent as it is read, rather
+			 * than read into memory whole first */
+			request_set_cache(rq, "spill");
+			if (sv->spill == NULL || !spill_load(sv->spill, data)) {
+				request_set_cache(rq, "miss");
+				stream_miss_init(&sm, sv, generation);
+				ret = request_readfile(rq, stream_file,
+						       stream_fill, &sm);
+				if (ret == 0) { /* couldn't read file */
+					if (sv->negative != NULL)
+						cache_negative(sv, rq,
+							       data->file_name,
+							       generation);
+					goto out;
+				}
+				if (ret == REQUEST_STREAMED) {
+					request_set_cache(rq, "stream");
+					if (sv->mrc != NULL)
+						mrc_access(sv->mrc,
+							   data->file_name,
+							   data->file_size);
+					pthread_mutex_lock(&cache_l);
+					sv->cache->stats.misses++;
+					sv->cache->stats.miss_bytes +=
+						data->file_size;
+					/* unless it was cached in blocks */
+					if (sm.meta == NULL)
+						sv->cache->stats.streamed++;
+					pthread_mutex_unlock(&cache_l);
+					stream_miss_done(&sm, data);
+					goto out;
+				}
+			}
+
+			if (sv->mrc != NULL)
+				mrc_access(sv->mrc, data->file_name,
+					   data->file_size);
 			pthread_mutex_lock(&cache_l);
-			entry = cache_insert(sv, data); // only if it can fit but i guess the check can be done in here
+			sv->cache->stats.misses++;
+			sv->cache->stats.miss_bytes += data->file_size;
+			/* if a file changed since the lookup, what we read may
+			 * already be out of date, so don't cache it. a file
+			 * cached in blocks was streamed instead. */
+			if (generation == sv->cache->generation &&
+			    !cache_blocked(sv->cache, data->file_size))
+				entry = cache_insert(sv, data); // only if it can fit but i guess the check can be done in here
+			/* the cache took its own reference */
 			request_set_data(rq, data);
-			if(entry != NULL) {
-				entry->in_use++;
-				update(sv, get_hash(sv, data->file_name));
-			}
 			pthread_mutex_unlock(&cache_l);
 
 			request_sendfile(rq);
 
-			pthread_mutex_lock(&cache_l);
-			if(entry != NULL) entry->in_use--;
-			pthread_mutex_unlock(&cache_l); // TODO: pls help me
-
 			goto out;
 		}
 	} else {
+		if (request_has_range(rq)) {
+			request_sendfile_disk(rq);
+			goto out;
+		}
 		/* read file, 
 		* fills data->file_buf with the file contents,
-		* data->file_size with file size. */
-		ret = request_readfile(rq);
+		* data->file_size with file size. a large file is streamed
+		* instead. */
+		stream_miss_init(&sm, sv, 0);
+		ret = request_readfile(rq, stream_file, NULL, &sm);
 		if (ret == 0) { /* couldn't read file */
 			goto out;
 		}
+		if (sv->mrc != NULL)
+			mrc_access(sv->mrc, data->file_name, data->file_size);
 		/* send file to client */
-		request_sendfile(rq);
+		if (ret != REQUEST_STREAMED)
+			request_sendfile(rq);
 	}
 
 out:
 	request_destroy(rq);
-	// file_data_free(data);
+	file_data_put(data);
 }
 
 
 int read_buf(struct server *sv){
 	pthread_mutex_lock(&lock); 
-	while (sv->count == 0 ){ // while nothing wait on empty
+	/* exiting is checked before waiting too, server_exit may have
+	 * broadcast while this thread was still serving a request */
+	while (sv->count == 0 && !sv->exiting) // while nothing wait on empty
 		pthread_cond_wait(&empty, &lock);
-		if (sv->exiting){
-			pthread_mutex_unlock(&lock);
-			pthread_exit(NULL);
-		}
+	if (sv->exiting){
+		pthread_mutex_unlock(&lock);
+		tlb_close();
+		pthread_exit(NULL);
 	}
 	int connfd = sv->buffer[sv->out]; //read fd from buf
 	if (sv->count == sv->max_requests){
@@ -366,12 +2150,11 @@ int read_buf(struct server *sv){
 
 void write_buf(struct server *sv, int connfd){
 	pthread_mutex_lock(&lock);
-	while (sv->count == sv->max_requests){ //will fix spin waiting later
+	while (sv->count == sv->max_requests && !sv->exiting)
 		pthread_cond_wait(&full, &lock);
-		if (sv->exiting){
-			pthread_mutex_unlock(&lock);
-			pthread_exit(NULL);
-		}
+	if (sv->exiting){
+		pthread_mutex_unlock(&lock);
+		pthread_exit(NULL);
 	}
 	sv->buffer[sv->in] = connfd;
 	if (sv->count == 0){ //if buffer empty signal 
@@ -394,8 +2177,15 @@ void thread_main(struct server *sv){
 
 
 struct server *
-server_init(int nr_threads, int max_requests, int max_cache_size)
+server_init(int nr_threads, int max_requests, long max_cache_size,
+	    struct server_options *opts)
 {	
+	struct server_options defaults;
+
+	if (opts == NULL) {
+		server_options_init(&defaults);
+		opts = &defaults;
+	}
 	pthread_mutex_init(&lock, NULL);
 	pthread_mutex_init(&cache_l, NULL);
 	pthread_cond_init(&empty, NULL);
@@ -409,7 +2199,12 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 	// sv->max_requests = max_requests;
 	// sv->max_cache_size = max_cache_size;
 	// sv->exiting = 0;
-	server_initalization(sv, nr_threads, max_requests, max_cache_size);
+	server_initalization(sv, nr_threads, max_requests, max_cache_size, opts);
+	/* before the workers, which log from their first request */
+	if (opts->access_log != NULL) {
+		sv->log = accesslog_start(opts->access_log);
+		request_set_log(sv->log);
+	}
 	
 	if (nr_threads > 0 || max_requests > 0 || max_cache_size > 0) {
 		if (max_requests > 0){
@@ -426,6 +2221,29 @@ server_init(int nr_threads, int max_requests, int max_cache_size)
 		}
 	}
 	/* Lab 5: init server cache and limit its size to max_cache_size */
+	if (sv->cache != NULL && sv->cache->background) {
+		pthread_create(&sv->cache->reclaimer, NULL, reclaim_main, sv);
+	}
+	if (sv->cache != NULL && opts->adaptive) {
+		sv->pressure = pressure_start(opts->adaptive_min > 0 ?
+					      opts->adaptive_min :
+					      max_cache_size / 8,
+					      max_cache_size,
+					      cache_set_budget, sv);
+	}
+	if (sv->cache != NULL && opts->watch != WATCH_NONE) {
+		sv->watch = watch_start(".", opts->watch, cache_changed, sv);
+	}
+	if (sv->cache != NULL && opts->warmup_path != NULL) {
+		sv->warmup = warmup_start(opts->warmup_path,
+					  opts->warmup_threads,
+					  opts->warmup_bandwidth,
+					  cache_warm, sv);
+	}
+	if (sv->cache != NULL && opts->prefetch) {
+		sv->prefetch = prefetch_init(opts->prefetch_bandwidth,
+					     cache_prefetch, sv);
+	}
 	pthread_mutex_unlock(&lock);
 	return sv;
 }
@@ -451,16 +2269,50 @@ server_exit(struct server *sv)
 	 * these threads that the server is exiting. make sure to call
 	 * pthread_join in this function so that the main server thread waits
 	 * for all the worker threads to exit before exiting. */
+	pthread_mutex_lock(&lock);
 	sv->exiting = 1;
 	pthread_cond_broadcast(&empty);
 	pthread_cond_broadcast(&full);
+	pthread_mutex_unlock(&lock);
 
 	for (int i = 0; i < sv->nr_threads; i++){
 		pthread_join(*(sv->worker_pool[i]), NULL);
 		free(sv->worker_pool[i]);
 	}
+	/* without workers, requests were served, and counted, here */
+	tlb_close();
 	if (sv->buffer > 0) free(sv->buffer);
 	if (sv->nr_threads > 0) free(sv->worker_pool);
+	if (sv->warmup != NULL) warmup_stop(sv->warmup);
+	if (sv->prefetch != NULL) prefetch_stop(sv->prefetch);
+	if (sv->watch != NULL) watch_stop(sv->watch);
+	if (sv->pressure != NULL) pressure_stop(sv->pressure);
+	if (sv->cache != NULL && sv->cache->background) {
+		/* it frees what is still released before it exits */
+		pthread_mutex_lock(&cache_l);
+		sv->cache->reclaim_stop = 1;
+		sv->cache->reclaiming = 0;
+		pthread_cond_signal(&sv->cache->reclaim_cond);
+		pthread_mutex_unlock(&cache_l);
+		pthread_join(sv->cache->reclaimer, NULL);
+	}
+	if (sv->cache != NULL) cache_print_stats(sv);
+	if (sv->warmup != NULL) warmup_destroy(sv->warmup);
+	if (sv->prefetch != NULL) prefetch_destroy(sv->prefetch);
+	if (sv->spill != NULL) spill_destroy(sv->spill);
+	if (sv->negative != NULL) negcache_destroy(sv->negative);
+	if (sv->pressure != NULL) pressure_destroy(sv->pressure);
+	if (sv->mrc != NULL) {
+		mrc_print_curve(sv);
+		mrc_destroy(sv->mrc);
+	}
+	if (sv->log != NULL) {
+		/* the workers are done, this writes out what they logged */
+		accesslog_stop(sv->log);
+		log_print_stats(sv);
+		accesslog_destroy(sv->log);
+	}
 	/* make sure to free any allocated resources */
+	if (sv->cache != NULL) cache_destroy(sv);
 	free(sv);
 }
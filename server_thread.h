@@ -1,11 +1,68 @@
 #ifndef __SERVER_THREAD_H__
 #define __SERVER_THREAD_H__
 
+#include "watch.h"
+
 struct server;
+struct file_data;
+struct fentry;
+
+/* cache replacement policies */
+enum cache_policy {
+	CACHE_POLICY_LRU,	  /* evict the least recently used file */
+	CACHE_POLICY_GDSF,	  /* GreedyDual-Size-Frequency, object hit ratio */
+	CACHE_POLICY_GDSF_BYTES,  /* GDSF with cost = size, byte hit ratio */
+};
 
+/* optional server settings, server_options_init() fills in the defaults */
+struct server_options {
+	enum cache_policy policy;
+	int cache_mmap;		/* cache mappings of files instead of copies */
+	int cache_mlock;	/* prefault and lock those mappings */
+	int cache_hugepages;	/* back the cache arena and table by 2MB pages */
+	int tlb_stats;		/* report dTLB misses on the cache hit path */
+	int cache_compress;	/* compress cold entries instead of evicting */
+	int promote_hits;	/* hits that decompress a cold entry for good */
+	const char *spill_path;	/* file for the second tier, NULL for none */
+	long spill_size;	/* size of that file */
+	enum watch_mode watch;	/* how to notice files changing on disk */
+	const char *warmup_path; /* manifest of files to load at startup */
+	int warmup_threads;	/* threads that load them */
+	long warmup_bandwidth;	/* bytes per second they may read, 0 for
+				 * no limit */
+	int prefetch;		/* load files that are likely to be next */
+	long prefetch_bandwidth; /* bytes per second it may read, 0 for
+				  * no limit */
+	long prefetch_budget;	/* bytes of prefetched files that have not
+				 * been used yet, 0 for an eighth of the cache */
+	double negative_ttl;	/* seconds to remember 404 and 403 responses,
+				 * 0 to not remember them */
+	int negative_entries;	/* how many of them */
+	int mrc;		/* estimate the miss ratio curve */
+	int block_size;		/* cache large files in blocks of this size,
+				 * 0 to cache them whole */
+	int reclaim;		/* evict in a background thread */
+	int reclaim_low;	/* it starts when less than this percentage of
+				 * the cache is free */
+	int reclaim_high;	/* and stops when this percentage is free */
+	int adaptive;		/* adapt the cache size to memory pressure */
+	long adaptive_min;	/* but not below this, 0 for an eighth of
+				 * max_cache_size */
+	long stream_size;	/* send files of this many bytes or more that
+				 * won't be cached as they are read, 0 to
+				 * always read them whole */
+	const char *access_log;	/* file to log requests to, NULL for none */
+};
+
+void server_options_init(struct server_options *opts);
 struct server *server_init(int nr_threads, int max_requests, 
-			   int max_cache_size);
+			   long max_cache_size, struct server_options *opts);
 void server_request(struct server *sv, int connfd);
 void server_exit(struct server *sv);
 
+/* the cache on its own, for cache_bench. with worker threads running they
+ * must be called with cache_l held. */
+struct fentry *cache_insert(struct server *sv, struct file_data *fdata);
+struct fentry *cache_lookup(struct server *sv, char *fname);
+
 #endif /* __SERVER_THREAD_H__ */
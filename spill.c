@@ -0,0 +1,295 @@
+/*
+ * spill.c: second cache tier in a local file.
+ *
+ * The spill file is preallocated and written as a circular log. Each record
+ * is just the file body, everything else about it (name, position, checksum
+ * and so on) lives in an in-memory index, so the file is scratch space and
+ * is truncated on startup.
+ *
+ * Positions are logical byte offsets into the log that only ever grow, the
+ * physical offset is the position modulo the file size. A record that does
+ * not fit before the end of the file starts again at offset 0, skipping the
+ * tail. Writers reserve their range under the lock, which drops the oldest
+ * records that the range will overwrite, and then write without the lock.
+ * Readers read without the lock too, and afterwards check that the log has
+ * not wrapped over what they read.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "spill.h"
+
+struct spill_rec {
+	char *name;
+	long long pos;		/* logical position in the log */
+	long size;
+	time_t mtime;
+	long mtime_ns;
+	ino_t ino;
+	int encodings;
+	int live;		/* still in the index */
+	unsigned int csum;
+	const char *type;
+	int processed;
+	struct spill_rec *hnext;	/* in its hash bucket */
+	struct spill_rec *lnext;	/* in log order, oldest first */
+};
+
+struct spill {
+	int fd;
+	long size;		/* size of the spill file */
+	long long head;		/* next free logical position */
+	struct spill_rec **buckets;
+	unsigned long nr_buckets;
+	struct spill_rec *oldest;
+	struct spill_rec *newest;
+	pthread_mutex_t lock;
+	struct spill_stats stats;
+};
+
+static unsigned long
+spill_hash(struct spill *sp, const char *name)
+{
+	unsigned long hash = 5381;
+	int c;
+
+	while ((c = *name++) != '\0')
+		hash = ((hash << 5) + hash) + c;
+	return hash & (sp->nr_buckets - 1);
+}
+
+struct spill *
+spill_init(const char *path, long size)
+{
+	struct spill *sp;
+	int ret;
+
+	sp = Malloc(sizeof(struct spill));
+	memset(sp, 0, sizeof(struct spill));
+	SYS(sp->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600));
+	/* allocate all the blocks now so writes never find the disk full */
+	if ((ret = posix_fallocate(sp->fd, 0, size)) != 0) {
+		fprintf(stderr, "%s: posix_fallocate: %s: %s\n", __FUNCTION__,
+			path, strerror(ret));
+		SYS(ftruncate(sp->fd, size));
+	}
+	sp->size = size;
+	/* about one bucket per 4KB of spill file */
+	sp->nr_buckets = 1024;
+	while (sp->nr_buckets < size / 4096)
+		sp->nr_buckets <<= 1;
+	sp->buckets = Malloc(sp->nr_buckets * sizeof(struct spill_rec *));
+	memset(sp->buckets, 0, sp->nr_buckets * sizeof(struct spill_rec *));
+	pthread_mutex_init(&sp->lock, NULL);
+	return sp;
+}
+
+void
+spill_destroy(struct spill *sp)
+{
+	struct spill_rec *rec;
+
+	while ((rec = sp->oldest) != NULL) {
+		sp->oldest = rec->lnext;
+		free(rec->name);
+		free(rec);
+	}
+	free(sp->buckets);
+	SYS(close(sp->fd));
+	pthread_mutex_destroy(&sp->lock);
+	free(sp);
+}
+
+static struct spill_rec *
+spill_find(struct spill *sp, const char *name)
+{
+	struct spill_rec *rec;
+
+	for (rec = sp->buckets[spill_hash(sp, name)]; rec; rec = rec->hnext) {
+		if (strcmp(rec->name, name) == 0)
+			return rec;
+	}
+	return NULL;
+}
+
+/* takes rec out of the index. it stays in the log list, and is freed when
+ * the log wraps over it. */
+static void
+spill_unlink(struct spill *sp, struct spill_rec *rec)
+{
+	struct spill_rec **pp = &sp->buckets[spill_hash(sp, rec->name)];
+
+	while (*pp != rec)
+		pp = &(*pp)->hnext;
+	*pp = rec->hnext;
+	rec->live = 0;
+	sp->stats.bytes -= rec->size;
+}
+
+/* frees the oldest records whose space the log reuses below end */
+static void
+spill_reclaim(struct spill *sp, long long end)
+{
+	struct spill_rec *rec;
+
+	while ((rec = sp->oldest) != NULL && rec->pos < end - sp->size) {
+		sp->oldest = rec->lnext;
+		if (sp->oldest == NULL)
+			sp->newest = NULL;
+		if (rec->live) {
+			spill_unlink(sp, rec);
+			sp->stats.overwritten++;
+		}
+		free(rec->name);
+		free(rec);
+	}
+}
+
+/* appends the body of data to the log. body holds data->file_size bytes. */
+void
+spill_store(struct spill *sp, struct file_data *data, const char *body)
+{
+	struct spill_rec *rec, *old;
+	long long pos;
+	long off;
+
+	if (data->file_size > sp->size || !data->file_ready)
+		return;
+
+	pthread_mutex_lock(&sp->lock);
+	pos = sp->head;
+	off = pos % sp->size;
+	if (off + data->file_size > sp->size) {
+		pos += sp->size - off;
+		off = 0;
+	}
+	sp->head = pos + data->file_size;
+	spill_reclaim(sp, sp->head);
+	pthread_mutex_unlock(&sp->lock);
+
+	if (data->file_size > 0 &&
+	    pwrite(sp->fd, body, data->file_size, off) != data->file_size) {
+		fprintf(stderr, "%s: pwrite: %s\n", __FUNCTION__,
+			strerror(errno));
+		return;
+	}
+
+	rec = Malloc(sizeof(struct spill_rec));
+	rec->name = strdup(data->file_name);
+	rec->pos = pos;
+	rec->size = data->file_size;
+	rec->live = 1;
+	rec->csum = data->file_csum;
+	rec->type = data->file_type;
+	rec->processed = data->file_processed;
+	rec->mtime = data->file_mtime;
+	rec->mtime_ns = data->file_mtime_ns;
+	rec->ino = data->file_ino;
+	rec->encodings = data->file_encodings;
+	rec->lnext = NULL;
+
+	pthread_mutex_lock(&sp->lock);
+	if (pos < sp->head - sp->size) {
+		/* other writers wrapped over it while we were writing */
+		pthread_mutex_unlock(&sp->lock);
+		free(rec->name);
+		free(rec);
+		return;
+	}
+	if ((old = spill_find(sp, rec->name)) != NULL)
+		spill_unlink(sp, old);
+	rec->hnext = sp->buckets[spill_hash(sp, rec->name)];
+	sp->buckets[spill_hash(sp, rec->name)] = rec;
+	/* records are listed in order of position, which is the order in
+	 * which they were reserved, not written */
+	if (sp->newest == NULL) {
+		sp->oldest = sp->newest = rec;
+	} else if (sp->newest->pos < pos) {
+		sp->newest->lnext = rec;
+		sp->newest = rec;
+	} else {
+		struct spill_rec **pp = &sp->oldest;
+		while (*pp && (*pp)->pos < pos)
+			pp = &(*pp)->lnext;
+		rec->lnext = *pp;
+		*pp = rec;
+	}
+	sp->stats.stores++;
+	sp->stats.bytes += rec->size;
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/* looks up data->file_name, and if it is in the log reads its body into a
+ * newly allocated data->file_buf. returns 1 on a hit, 0 otherwise. */
+int
+spill_load(struct spill *sp, struct file_data *data)
+{
+	struct spill_rec *rec, copy;
+	ssize_t n;
+
+	pthread_mutex_lock(&sp->lock);
+	rec = spill_find(sp, data->file_name);
+	if (rec == NULL) {
+		sp->stats.misses++;
+		pthread_mutex_unlock(&sp->lock);
+		return 0;
+	}
+	copy = *rec;
+	pthread_mutex_unlock(&sp->lock);
+
+	data->file_size = copy.size;
+	request_allocbuf(data);
+	n = copy.size > 0 ? pread(sp->fd, data->file_buf, copy.size,
+				  copy.pos % sp->size) : 0;
+
+	pthread_mutex_lock(&sp->lock);
+	if (n != copy.size || copy.pos < sp->head - sp->size) {
+		sp->stats.stale++;
+		pthread_mutex_unlock(&sp->lock);
+		request_freebuf(data);
+		return 0;
+	}
+	sp->stats.hits++;
+	pthread_mutex_unlock(&sp->lock);
+
+	data->file_csum = copy.csum;
+	data->file_type = copy.type;
+	data->file_processed = copy.processed;
+	data->file_mtime = copy.mtime;
+	data->file_mtime_ns = copy.mtime_ns;
+	data->file_ino = copy.ino;
+	data->file_encodings = copy.encodings;
+	data->file_ready = 1;
+	return 1;
+}
+
+/* forgets path, or with tree everything at or below path, e.g. because the
+ * files changed */
+void
+spill_remove(struct spill *sp, const char *path, int tree)
+{
+	struct spill_rec *rec;
+	size_t len = strlen(path);
+
+	pthread_mutex_lock(&sp->lock);
+	if (!tree) {
+		if ((rec = spill_find(sp, path)) != NULL)
+			spill_unlink(sp, rec);
+	} else {
+		for (rec = sp->oldest; rec; rec = rec->lnext) {
+			if (rec->live && (strcmp(path, ".") == 0 ||
+			    (strncmp(rec->name, path, len) == 0 &&
+			     (rec->name[len] == '\0' || rec->name[len] == '/'))))
+				spill_unlink(sp, rec);
+		}
+	}
+	pthread_mutex_unlock(&sp->lock);
+}
+
+void
+spill_get_stats(struct spill *sp, struct spill_stats *stats)
+{
+	pthread_mutex_lock(&sp->lock);
+	*stats = sp->stats;
+	pthread_mutex_unlock(&sp->lock);
+}
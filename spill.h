@@ -0,0 +1,31 @@
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+/*
+ * spill.c: second cache tier in a local file.
+ *
+ * Entries evicted from the memory cache are appended to a preallocated file
+ * that is used as a circular log, with an in-memory index. A miss in memory
+ * that hits here is read back with pread() instead of going to the origin.
+ */
+
+struct spill;
+struct file_data;
+
+struct spill_stats {
+	unsigned long stores;	  /* bodies written */
+	unsigned long hits;	  /* lookups that were read back */
+	unsigned long misses;	  /* lookups that were not found */
+	unsigned long overwritten;/* records lost to the log wrapping around */
+	unsigned long stale;	  /* reads that raced with an overwrite */
+	long long bytes;	  /* bytes of live records */
+};
+
+struct spill *spill_init(const char *path, long size);
+void spill_destroy(struct spill *sp);
+void spill_store(struct spill *sp, struct file_data *data, const char *body);
+int spill_load(struct spill *sp, struct file_data *data);
+void spill_remove(struct spill *sp, const char *path, int tree);
+void spill_get_stats(struct spill *sp, struct spill_stats *stats);
+
+#endif /* __SPILL_H__ */
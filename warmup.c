@@ -0,0 +1,217 @@
+/*
+ * warmup.c: loads the files named in a manifest into the cache at startup.
+ *
+ * The manifest lists one file per line, hottest first, and files are loaded
+ * in that order by a small pool of threads. Either the index written by
+ * fileset ("fileset_dir/00012 <csum> <size>", after a first line with the
+ * number of files) or a hot list made from an access log works, e.g. the
+ * output of "sort | uniq -c | sort -rn" ("<count> /fileset_dir/00012"): the
+ * path is the first word on a line that is not a number. Blank lines and
+ * lines starting with # are skipped.
+ *
+ * The threads share a disk bandwidth budget, so that warming up does not
+ * starve the misses of real requests. After each file a thread waits until
+ * the bytes read so far fit in the budget.
+ */
+
+#include "common.h"
+#include "warmup.h"
+#include <time.h>
+
+struct warmup {
+	char **paths;
+	int nr_paths;
+	int next;		/* next path to load */
+	long bandwidth;		/* bytes per second, 0 for no limit */
+	double ready;		/* time when the budget allows the next read */
+	double start;
+	int nr_threads;
+	int running;		/* threads that have not finished */
+	int stopping;
+	warmup_fn load;
+	void *arg;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/* signalled by warmup_stop */
+	struct warmup_stats stats;
+};
+
+static double
+warmup_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* returns 1 if word is all digits */
+static int
+warmup_number(const char *word)
+{
+	if (*word == '\0')
+		return 0;
+	for (; *word; word++) {
+		if (!isdigit((unsigned char)*word))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+warmup_read_manifest(struct warmup *wu, const char *manifest)
+{
+	char line[MAXLINE], *word, *save;
+	int capacity = 0;
+	FILE *f;
+
+	if ((f = fopen(manifest, "r")) == NULL) {
+		fprintf(stderr, "%s: %s: %s\n", __FUNCTION__, manifest,
+			strerror(errno));
+		return;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#')
+			continue;
+		for (word = strtok_r(line, " \t\r\n", &save); word;
+		     word = strtok_r(NULL, " \t\r\n", &save)) {
+			if (!warmup_number(word))
+				break;
+		}
+		if (word == NULL)
+			continue;
+		if (wu->nr_paths == capacity) {
+			capacity = capacity ? 2 * capacity : 256;
+			wu->paths = realloc(wu->paths,
+					    capacity * sizeof(char *));
+			if (wu->paths == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		wu->paths[wu->nr_paths++] = strdup(word);
+	}
+	fclose(f);
+}
+
+/* waits until time t, or until warmup_stop. called with the lock held. */
+static void
+warmup_wait(struct warmup *wu, double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while (!wu->stopping && warmup_now() < t) {
+		pthread_cond_timedwait(&wu->wake, &wu->lock, &ts);
+	}
+}
+
+static void *
+warmup_main(void *arg)
+{
+	struct warmup *wu = arg;
+	long bytes;
+	double now;
+	int i;
+
+	pthread_mutex_lock(&wu->lock);
+	while (!wu->stopping && wu->next < wu->nr_paths) {
+		i = wu->next++;
+		pthread_mutex_unlock(&wu->lock);
+
+		bytes = wu->load(wu->arg, wu->paths[i]);
+
+		pthread_mutex_lock(&wu->lock);
+		if (bytes > 0) {
+			wu->stats.loaded++;
+			wu->stats.bytes += bytes;
+		}
+		if (wu->bandwidth > 0 && bytes > 0) {
+			now = warmup_now();
+			if (wu->ready < now)
+				wu->ready = now;
+			wu->ready += (double)bytes / wu->bandwidth;
+			warmup_wait(wu, wu->ready);
+		}
+	}
+	if (--wu->running == 0) {
+		wu->stats.seconds = warmup_now() - wu->start;
+		wu->stats.done = wu->next >= wu->nr_paths;
+	}
+	pthread_mutex_unlock(&wu->lock);
+	return NULL;
+}
+
+struct warmup *
+warmup_start(const char *manifest, int nr_threads, long bandwidth,
+	     warmup_fn load, void *arg)
+{
+	struct warmup *wu;
+	pthread_condattr_t attr;
+	int i;
+
+	wu = Malloc(sizeof(struct warmup));
+	memset(wu, 0, sizeof(struct warmup));
+	warmup_read_manifest(wu, manifest);
+	wu->stats.listed = wu->nr_paths;
+	wu->bandwidth = bandwidth;
+	wu->load = load;
+	wu->arg = arg;
+	wu->nr_threads = nr_threads > 0 ? nr_threads : 1;
+	wu->running = wu->nr_threads;
+	wu->start = warmup_now();
+	pthread_mutex_init(&wu->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wu->wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	wu->threads = Malloc(wu->nr_threads * sizeof(pthread_t));
+	for (i = 0; i < wu->nr_threads; i++) {
+		SYS(pthread_create(&wu->threads[i], NULL, warmup_main, wu));
+	}
+	return wu;
+}
+
+/* stops loading files if it is not done yet, and waits for the threads */
+void
+warmup_stop(struct warmup *wu)
+{
+	int i;
+
+	pthread_mutex_lock(&wu->lock);
+	wu->stopping = 1;
+	pthread_cond_broadcast(&wu->wake);
+	pthread_mutex_unlock(&wu->lock);
+	for (i = 0; i < wu->nr_threads; i++) {
+		pthread_join(wu->threads[i], NULL);
+	}
+	wu->nr_threads = 0;
+}
+
+void
+warmup_destroy(struct warmup *wu)
+{
+	int i;
+
+	warmup_stop(wu);
+	for (i = 0; i < wu->nr_paths; i++) {
+		free(wu->paths[i]);
+	}
+	free(wu->paths);
+	free(wu->threads);
+	pthread_mutex_destroy(&wu->lock);
+	pthread_cond_destroy(&wu->wake);
+	free(wu);
+}
+
+void
+warmup_get_stats(struct warmup *wu, struct warmup_stats *stats)
+{
+	pthread_mutex_lock(&wu->lock);
+	*stats = wu->stats;
+	if (wu->running > 0)
+		stats->seconds = warmup_now() - wu->start;
+	pthread_mutex_unlock(&wu->lock);
+}
@@ -0,0 +1,28 @@
+#ifndef __WARMUP_H__
+#define __WARMUP_H__
+
+/*
+ * warmup.c: loads the files named in a manifest into the cache at startup,
+ * so that the first requests after a restart are not all cold misses.
+ */
+
+/* loads path, returns the number of bytes read from the disk */
+typedef long (*warmup_fn)(void *arg, const char *path);
+
+struct warmup;
+
+struct warmup_stats {
+	unsigned long listed;	/* files in the manifest */
+	unsigned long loaded;	/* files the callback read */
+	unsigned long long bytes; /* bytes the callback read */
+	double seconds;		/* time taken, so far if still running */
+	int done;		/* every file was tried, i.e. not stopped early */
+};
+
+struct warmup *warmup_start(const char *manifest, int nr_threads,
+			    long bandwidth, warmup_fn load, void *arg);
+void warmup_stop(struct warmup *wu);
+void warmup_destroy(struct warmup *wu);
+void warmup_get_stats(struct warmup *wu, struct warmup_stats *stats);
+
+#endif /* __WARMUP_H__ */
@@ -0,0 +1,266 @@
+/*
+ * watch.c: tells the cache when files under the document root change.
+ *
+ * A thread reads change events from the kernel and reports the changed paths
+ * through a callback. With inotify every directory in the tree gets its own
+ * watch, and watches are added and removed as directories come and go. With
+ * fanotify a single mark covers the whole mount, but only writes to files
+ * are reported, and it needs CAP_SYS_ADMIN. When it can't be set up, inotify
+ * is used instead.
+ */
+
+#include "common.h"
+#include "watch.h"
+#include <dirent.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+
+#define INOTIFY_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+		      IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR)
+
+struct watch {
+	enum watch_mode mode;
+	int fd;			/* inotify or fanotify descriptor */
+	int stop[2];		/* pipe, written to by watch_stop */
+	char *root;
+	size_t root_len;	/* fanotify: length of the absolute root */
+	char **dirs;		/* inotify: directory of each watch descriptor */
+	int nr_dirs;
+	watch_fn changed;
+	void *arg;
+	pthread_t thread;
+};
+
+static void
+watch_set_dir(struct watch *w, int wd, const char *path)
+{
+	if (wd >= w->nr_dirs) {
+		int n = w->nr_dirs ? w->nr_dirs : 64;
+
+		while (n <= wd)
+			n *= 2;
+		w->dirs = realloc(w->dirs, n * sizeof(char *));
+		if (w->dirs == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		memset(w->dirs + w->nr_dirs, 0,
+		       (n - w->nr_dirs) * sizeof(char *));
+		w->nr_dirs = n;
+	}
+	free(w->dirs[wd]);
+	w->dirs[wd] = path ? strdup(path) : NULL;
+}
+
+/* watches path and every directory below it */
+static void
+watch_add_tree(struct watch *w, const char *path)
+{
+	char sub[PATH_MAX];
+	struct dirent *p;
+	struct stat sbuf;
+	DIR *d;
+	int wd;
+
+	wd = inotify_add_watch(w->fd, path, INOTIFY_MASK);
+	if (wd < 0) {
+		/* e.g. out of watches, changes in here will go unnoticed */
+		fprintf(stderr, "%s: inotify_add_watch: %s: %s\n",
+			__FUNCTION__, path, strerror(errno));
+		return;
+	}
+	watch_set_dir(w, wd, path);
+
+	if ((d = opendir(path)) == NULL)
+		return;
+	while ((p = readdir(d)) != NULL) {
+		if (strcmp(p->d_name, ".") == 0 || strcmp(p->d_name, "..") == 0)
+			continue;
+		if (snprintf(sub, sizeof(sub), "%s/%s", path, p->d_name) >=
+		    sizeof(sub))
+			continue;
+		if (p->d_type == DT_DIR ||
+		    (p->d_type == DT_UNKNOWN && lstat(sub, &sbuf) == 0 &&
+		     S_ISDIR(sbuf.st_mode)))
+			watch_add_tree(w, sub);
+	}
+	closedir(d);
+}
+
+/* stops watching path and every directory below it */
+static void
+watch_remove_tree(struct watch *w, const char *path)
+{
+	size_t len = strlen(path);
+	int wd;
+
+	for (wd = 0; wd < w->nr_dirs; wd++) {
+		if (w->dirs[wd] && strncmp(w->dirs[wd], path, len) == 0 &&
+		    (w->dirs[wd][len] == '\0' || w->dirs[wd][len] == '/')) {
+			inotify_rm_watch(w->fd, wd);
+			watch_set_dir(w, wd, NULL);
+		}
+	}
+}
+
+static void
+watch_inotify_events(struct watch *w, char *buf, ssize_t len)
+{
+	char path[PATH_MAX];
+	char *p;
+
+	for (p = buf; p < buf + len;
+	     p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+		struct inotify_event *ev = (struct inotify_event *)p;
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			w->changed(w->arg, ".", WATCH_TREE);
+			continue;
+		}
+		if (ev->mask & IN_IGNORED) {
+			if (ev->wd < w->nr_dirs)
+				watch_set_dir(w, ev->wd, NULL);
+			continue;
+		}
+		if (ev->len == 0 || ev->wd >= w->nr_dirs ||
+		    w->dirs[ev->wd] == NULL)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", w->dirs[ev->wd],
+			     ev->name) >= sizeof(path))
+			continue;
+
+		if (!(ev->mask & IN_ISDIR)) {
+			w->changed(w->arg, path, WATCH_FILE);
+			continue;
+		}
+		if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			watch_remove_tree(w, path);
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			watch_add_tree(w, path);
+		w->changed(w->arg, path, WATCH_TREE);
+	}
+}
+
+static void
+watch_fanotify_events(struct watch *w, char *buf, ssize_t len)
+{
+	struct fanotify_event_metadata *ev = (struct fanotify_event_metadata *)buf;
+	char link[64], path[PATH_MAX];
+	ssize_t n;
+
+	for (; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+		if (ev->mask & FAN_Q_OVERFLOW)
+			w->changed(w->arg, ".", WATCH_TREE);
+		if (ev->fd < 0)
+			continue;
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", ev->fd);
+		n = readlink(link, path + 1, sizeof(path) - 2);
+		close(ev->fd);
+		if (n < 0)
+			continue;
+		path[n + 1] = '\0';
+		/* keep it if it is below the root, and make it "./..." */
+		if (strncmp(path + 1, w->root, w->root_len) != 0 ||
+		    path[w->root_len + 1] != '/')
+			continue;
+		path[w->root_len] = '.';
+		w->changed(w->arg, path + w->root_len, WATCH_FILE);
+	}
+}
+
+static void *
+watch_main(void *arg)
+{
+	struct watch *w = arg;
+	char buf[64 * 1024] __attribute__((aligned(8)));
+	struct pollfd fds[2] = {
+		{w->stop[0], POLLIN},
+		{w->fd, POLLIN},
+	};
+	ssize_t len;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (fds[0].revents)
+			break;
+		len = read(w->fd, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+		if (w->mode == WATCH_FANOTIFY)
+			watch_fanotify_events(w, buf, len);
+		else
+			watch_inotify_events(w, buf, len);
+	}
+	return NULL;
+}
+
+static int
+watch_fanotify_init(struct watch *w)
+{
+	char abs[PATH_MAX];
+
+	if (realpath(w->root, abs) == NULL)
+		return -1;
+	w->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC,
+			      O_RDONLY);
+	if (w->fd < 0)
+		return -1;
+	if (fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+			  FAN_CLOSE_WRITE, AT_FDCWD, abs) < 0) {
+		close(w->fd);
+		return -1;
+	}
+	free(w->root);
+	w->root = strdup(abs);
+	w->root_len = strlen(abs);
+	return 0;
+}
+
+struct watch *
+watch_start(const char *root, enum watch_mode mode, watch_fn changed,
+	    void *arg)
+{
+	struct watch *w;
+
+	w = Malloc(sizeof(struct watch));
+	memset(w, 0, sizeof(struct watch));
+	w->root = strdup(root);
+	w->changed = changed;
+	w->arg = arg;
+	w->mode = mode;
+	if (mode == WATCH_FANOTIFY && watch_fanotify_init(w) < 0) {
+		fprintf(stderr, "%s: fanotify: %s, using inotify\n",
+			__FUNCTION__, strerror(errno));
+		w->mode = WATCH_INOTIFY;
+	}
+	if (w->mode == WATCH_INOTIFY) {
+		SYS(w->fd = inotify_init1(IN_CLOEXEC));
+		watch_add_tree(w, root);
+	}
+	SYS(pipe(w->stop));
+	SYS(pthread_create(&w->thread, NULL, watch_main, w));
+	return w;
+}
+
+void
+watch_stop(struct watch *w)
+{
+	int i;
+
+	SYS(write(w->stop[1], "", 1));
+	pthread_join(w->thread, NULL);
+	SYS(close(w->stop[0]));
+	SYS(close(w->stop[1]));
+	SYS(close(w->fd));
+	for (i = 0; i < w->nr_dirs; i++)
+		free(w->dirs[i]);
+	free(w->dirs);
+	free(w->root);
+	free(w);
+}
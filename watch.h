@@ -0,0 +1,31 @@
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+/*
+ * watch.c: tells the cache when files under the document root change, so
+ * cached entries can be dropped without a stat() on every hit.
+ */
+
+enum watch_mode {
+	WATCH_NONE,
+	WATCH_INOTIFY,	 /* per directory watches, sees every kind of change */
+	WATCH_FANOTIFY,	 /* one mark for the whole mount, needs CAP_SYS_ADMIN,
+			  * sees file writes only */
+};
+
+/* what a change notification covers */
+#define WATCH_FILE	0	/* the file at path */
+#define WATCH_TREE	1	/* everything at or below path */
+
+/* path is relative to the root and starts with "./", like the file names
+ * that requests use. with WATCH_TREE and a path of ".", every file may have
+ * changed (e.g. the kernel dropped events). */
+typedef void (*watch_fn)(void *arg, const char *path, int what);
+
+struct watch;
+
+struct watch *watch_start(const char *root, enum watch_mode mode,
+			  watch_fn changed, void *arg);
+void watch_stop(struct watch *w);
+
+#endif /* __WATCH_H__ */